@@ -21,11 +21,19 @@
 #include "access_check.h"
 #include "common.h"
 #include "wsubus.impl.h"
+#include "util_arena.h"
 
 #if WSD_HAVE_UBUS
+#include "util_ubus_ids.h"
+#include "access_local.h"
 #include <libubus.h>
 #endif
 
+#include <libubox/list.h>
+
+#include <stdint.h>
+#include <time.h>
+
 #define SID_EXTENDED_PREFIX "X-"
 
 /*
@@ -81,32 +89,51 @@ static enum wsu_ext_result wsu_ext_restrict_interface(struct lws *wsi,
 }
 
 
-#ifdef LWS_OPENSSL_SUPPORT
-/**
- * \brief This access checker checks if the client is authenticated via TLS certificate. If so, access check is successful
- */
-static enum wsu_ext_result wsu_ext_check_tls(struct lws *wsi)
+void wsubus_access_tls_init(struct lws *wsi)
 {
+#ifdef LWS_OPENSSL_SUPPORT
+	struct wsu_peer *peer = wsi_to_peer(wsi);
+
 	if (!lws_is_ssl(wsi)) {
-		return EXT_CHECK_NEXT;
+		peer->tls_cert = WSU_TLS_CERT_NONE;
+		return;
 	}
 
 	SSL *ssl = lws_get_ssl(wsi);
 	X509 *x = SSL_get_peer_certificate(ssl);
-	int have_cert = !!x;
-	X509_free(x);
-	if (have_cert && SSL_get_verify_result(ssl) == X509_V_OK) {
+	if (x && SSL_get_verify_result(ssl) == X509_V_OK) {
 #ifdef _DEBUG
 		char cert_subj[80] = "";
 		X509_NAME *xname = X509_get_subject_name(x);
 		X509_NAME_get_text_by_NID(xname, NID_commonName, cert_subj, sizeof cert_subj);
 		lwsl_notice("wsi %p was TLS authenticated with cert CN= %s\n", wsi, cert_subj);
 #endif
-		return EXT_CHECK_ALLOW;
+		peer->tls_cert = WSU_TLS_CERT_VALID;
 	} else {
 		lwsl_notice("wsi %p was not TLS authenticated\n", wsi);
-		// return DEFAULT since next auth check may allow this session
+		peer->tls_cert = WSU_TLS_CERT_INVALID;
+	}
+	X509_free(x);
+#else
+	(void)wsi;
+#endif
+}
+
+#ifdef LWS_OPENSSL_SUPPORT
+/**
+ * \brief This access checker checks if the client is authenticated via TLS certificate. If so, access check is successful
+ *
+ * The certificate can't change after handshake, so it was checked then, see wsubus_access_tls_init
+ */
+static enum wsu_ext_result wsu_ext_check_tls(struct lws *wsi)
+{
+	switch (wsi_to_peer(wsi)->tls_cert) {
+	case WSU_TLS_CERT_VALID:
+		return EXT_CHECK_ALLOW;
+	case WSU_TLS_CERT_INVALID:
 		return EXT_CHECK_DENY;
+	default:
+		return EXT_CHECK_NEXT;
 	}
 }
 #endif
@@ -120,13 +147,31 @@ static enum wsu_ext_result wsu_ext_check_tls(struct lws *wsi)
  */
 struct wsubus_access_check_req {
 	bool result;
+	bool in_arena;
 	wsubus_access_cb cb;
 
+	// key of this check, and decision to be cached once rpcd gives it
+	struct wsubus_acl_entry *cache_entry;
+	bool cache_result;
+
+#if WSD_HAVE_UBUS
+	// session access call, kept to be repeated if session object id was stale
+	struct blob_buf access_blob;
+	uint32_t access_id;
+	bool retried;
+
+	// identical checks that wait for this one's answer instead of asking rpcd
+	struct list_head waiters;
+	// in list of checks in flight, or of waiters of one
+	struct list_head wl;
+#endif
+
 	void *ctx;
 
 	enum {
 #if WSD_HAVE_UBUS
 		REQ_TAG_UBUS,
+		REQ_TAG_WAIT,
 #endif
 		REQ_TAG_DEFER,
 	} tag;
@@ -143,11 +188,216 @@ struct wsubus_access_check_req *wsubus_access_check_new(void)
 	return calloc(1, sizeof(struct wsubus_access_check_req));
 }
 
+struct wsubus_access_check_req *wsubus_access_check_new_in(struct wsu_arena *arena)
+{
+	struct wsubus_access_check_req *req = wsu_arena_zalloc(arena, sizeof *req);
+	if (req)
+		req->in_arena = true;
+	return req;
+}
+
+#if WSD_HAVE_UBUS
+// ACL decision cache {{{
+/** \brief number of hash buckets, power of two */
+#define WSUBUS_ACL_CACHE_BUCKETS 128
+/** \brief max number of decisions kept, oldest are dropped first */
+#define WSUBUS_ACL_CACHE_MAX 1024
+
+/**
+ * \brief access decision rpcd gave, for sid, scope, object and method which
+ * are stored as key, one after another with terminating nulls
+ */
+struct wsubus_acl_entry {
+	struct list_head hl; // in hash bucket
+	struct list_head al; // in order of age
+
+	uint32_t hash;
+	time_t expires;
+	bool allow;
+
+	size_t key_len;
+	char key[];
+};
+
+static struct {
+	struct list_head buckets[WSUBUS_ACL_CACHE_BUCKETS];
+	struct list_head by_age;
+	unsigned int count;
+
+	// checks waiting for rpcd, with key of each in cache_entry
+	struct list_head inflight;
+} acl_cache;
+
+static time_t acl_cache_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void acl_cache_init(void)
+{
+	if (acl_cache.by_age.next)
+		return;
+
+	for (size_t i = 0; i < WSUBUS_ACL_CACHE_BUCKETS; ++i)
+		INIT_LIST_HEAD(&acl_cache.buckets[i]);
+	INIT_LIST_HEAD(&acl_cache.by_age);
+	INIT_LIST_HEAD(&acl_cache.inflight);
+}
+
+static void acl_cache_drop(struct wsubus_acl_entry *e)
+{
+	list_del(&e->hl);
+	list_del(&e->al);
+	--acl_cache.count;
+	free(e);
+}
+
+/**
+ * \brief drop expired decisions; all have same TTL, so these are the oldest
+ * (give or take order in which rpcd replied)
+ */
+static void acl_cache_expire(time_t now)
+{
+	while (!list_empty(&acl_cache.by_age)) {
+		struct wsubus_acl_entry *e = list_first_entry(&acl_cache.by_age, struct wsubus_acl_entry, al);
+		if (e->expires > now)
+			break;
+		acl_cache_drop(e);
+	}
+}
+
+/**
+ * \brief make entry keyed by sid, scope, object and method, not yet in cache
+ */
+static struct wsubus_acl_entry *acl_entry_new(const char *const fields[4], time_t expires)
+{
+	size_t key_len = 0;
+	for (int i = 0; i < 4; ++i)
+		key_len += strlen(fields[i]) + 1;
+
+	struct wsubus_acl_entry *e = malloc(sizeof *e + key_len);
+	if (!e)
+		return NULL;
+
+	char *k = e->key;
+	for (int i = 0; i < 4; ++i)
+		k = stpcpy(k, fields[i]) + 1;
+	e->key_len = key_len;
+	e->expires = expires;
+	e->allow = false;
+
+	// FNV-1a
+	e->hash = 2166136261u;
+	for (size_t i = 0; i < key_len; ++i) {
+		e->hash ^= (unsigned char)e->key[i];
+		e->hash *= 16777619u;
+	}
+
+	return e;
+}
+
+static struct list_head *acl_cache_bucket(const struct wsubus_acl_entry *e)
+{
+	return &acl_cache.buckets[e->hash & (WSUBUS_ACL_CACHE_BUCKETS - 1)];
+}
+
+/**
+ * \brief find cached entry with same key as given one
+ */
+static bool acl_entry_same(const struct wsubus_acl_entry *a, const struct wsubus_acl_entry *b)
+{
+	return a->hash == b->hash && a->key_len == b->key_len && !memcmp(a->key, b->key, a->key_len);
+}
+
+static struct wsubus_acl_entry *acl_cache_find(const struct wsubus_acl_entry *key)
+{
+	acl_cache_init();
+	acl_cache_expire(acl_cache_now());
+
+	struct wsubus_acl_entry *e;
+	list_for_each_entry(e, acl_cache_bucket(key), hl)
+		if (acl_entry_same(e, key))
+			return e;
+	return NULL;
+}
+
+/**
+ * \brief find check with same key which is already waiting for rpcd
+ */
+static struct wsubus_access_check_req *acl_inflight_find(const struct wsubus_acl_entry *key)
+{
+	acl_cache_init();
+
+	struct wsubus_access_check_req *r;
+	list_for_each_entry(r, &acl_cache.inflight, wl)
+		if (acl_entry_same(r->cache_entry, key))
+			return r;
+	return NULL;
+}
+
+/**
+ * \brief add entry with decision to cache, taking it over
+ */
+static void acl_cache_put(struct wsubus_acl_entry *e, bool allow)
+{
+	// same check may have been asked again while waiting for rpcd
+	struct wsubus_acl_entry *old = acl_cache_find(e);
+	if (old)
+		acl_cache_drop(old);
+
+	if (acl_cache.count >= WSUBUS_ACL_CACHE_MAX)
+		acl_cache_drop(list_first_entry(&acl_cache.by_age, struct wsubus_acl_entry, al));
+
+	e->allow = allow;
+	list_add(&e->hl, acl_cache_bucket(e));
+	list_add_tail(&e->al, &acl_cache.by_age);
+	++acl_cache.count;
+}
+
+void wsubus_access_cache_flush_sid(const char *sid)
+{
+	wsubus_access_local_flush_sid(sid);
+	acl_cache_init();
+
+	struct wsubus_acl_entry *e, *n;
+	list_for_each_entry_safe(e, n, &acl_cache.by_age, al) {
+		// sid is the first field of key
+		if (!strcmp(e->key, sid))
+			acl_cache_drop(e);
+	}
+
+	// answers to checks still waiting for rpcd may predate the change, so
+	// they are only passed on, not cached
+	struct wsubus_access_check_req *r;
+	list_for_each_entry(r, &acl_cache.inflight, wl)
+		if (!strcmp(r->cache_entry->key, sid))
+			r->cache_result = false;
+}
+//}}}
+#else
+void wsubus_access_cache_flush_sid(const char *sid)
+{
+	(void)sid;
+}
+#endif // WSD_HAVE_UBUS
+
 void wsubus_access_check_free(struct wsubus_access_check_req *req)
 {
-	free(req);
+	if (!req)
+		return;
+
+	free(req->cache_entry);
+#if WSD_HAVE_UBUS
+	blob_buf_free(&req->access_blob);
+#endif
+	if (!req->in_arena)
+		free(req);
 }
 
+static int defer_callback(struct wsubus_access_check_req *req, void *ctx, bool result);
+
 #if WSD_HAVE_UBUS
 static void wsubus_access_check__on_ret(struct ubus_request *ureq, int type, struct blob_attr *msg)
 {
@@ -167,12 +417,56 @@ static void wsubus_access_check__on_ret(struct ubus_request *ureq, int type, str
 	req->result = false;
 }
 
+static int wsubus_access_check__invoke(struct wsubus_access_check_req *r, struct ubus_context *ubus_ctx);
+
 static void wsubus_access_check__cb(struct ubus_request *ureq, int status)
 {
 	struct wsubus_access_check_req *req = container_of(ureq, struct wsubus_access_check_req, ubus_req);
+	struct ubus_context *ubus_ctx = ureq->ctx;
+
+	// rpcd replies not found for unknown session, and so does ubusd if the
+	// session object itself is gone. Its id is kept current from object
+	// events, so unless it changed since the call was made, this is rpcd's
+	// answer; otherwise rpcd restarted and the new object is asked once more
+	bool stale = false;
+	if (status == UBUS_STATUS_NOT_FOUND) {
+		uint32_t id;
+		bool known = wsu_ubus_id_cached("session", &id);
+		stale = !known || id != req->access_id;
+		if (known && stale && !req->retried) {
+			req->retried = true;
+			req->access_id = id;
+			if (wsubus_access_check__invoke(req, ubus_ctx) == UBUS_STATUS_OK) {
+				lwsl_info("session object id was stale, asked again\n");
+				return;
+			}
+		}
+	}
+
+	blob_buf_free(&req->access_blob);
+
+	bool result = req->result && status == UBUS_STATUS_OK;
+
+	if (req->cache_entry) {
+		list_del(&req->wl);
+		// only real decisions are cached, not failures to get one; unknown
+		// session is denied until the entry expires
+		if (req->cache_result && (status == UBUS_STATUS_OK ||
+					(status == UBUS_STATUS_NOT_FOUND && !stale))) {
+			acl_cache_put(req->cache_entry, result);
+			req->cache_entry = NULL;
+		}
+	}
+
+	// same answer goes to those who waited, before callback may free req
+	struct wsubus_access_check_req *w, *n;
+	list_for_each_entry_safe(w, n, &req->waiters, wl) {
+		list_del(&w->wl);
+		defer_callback(w, w->ctx, result);
+	}
 
 	// is ureq->status_code or status (the arg) what we want?
-	req->cb(req, req->ctx, req->result && status == UBUS_STATUS_OK);
+	req->cb(req, req->ctx, result);
 }
 
 /**
@@ -181,7 +475,7 @@ static void wsubus_access_check__cb(struct ubus_request *ureq, int status)
  */
 static int wsubus_access_check_via_session(
 		struct wsubus_access_check_req *r,
-		struct ubus_context *ubus_ctx,
+		struct prog_context *prog,
 		const char *sid,
 		const char *scope,
 		const char *object,
@@ -200,52 +494,145 @@ static int wsubus_access_check_via_session(
 		}
 	}
 
-	int ret;
-	uint32_t access_id;
+	INIT_LIST_HEAD(&r->waiters);
+
+	// rules from rpcd ACL files, if owsd was given them; deny is not final,
+	// session may have been granted access other than through its groups
+	if (wsubus_access_local_check(sid, scope ? scope : "ubus", object, method) == ACCESS_LOCAL_ALLOW) {
+		if (args)
+			blobmsg_add_string(args, "ubus_rpc_session", sid);
+		return defer_callback(r, ctx, true);
+	}
+
+	// rpcd decides only by these, so its answer can be reused for a while,
+	// without asking it again; it would also extend the session on each access
+	struct wsubus_acl_entry *key = NULL;
+	if (method) {
+		const char *fields[4] = { sid, scope ? scope : "ubus", object, method };
+		key = acl_entry_new(fields, acl_cache_now() + prog->acl_cache_ttl);
+	}
+
+	if (key && prog->acl_cache_ttl) {
+		struct wsubus_acl_entry *e = acl_cache_find(key);
+
+		if (e) {
+			free(key);
+			++prog->acl_cache_stats.hits;
+			lwsl_debug("access cache hit %s %s %s, %lu hits %lu misses\n", object, method, e->allow ? "allow" : "deny",
+					prog->acl_cache_stats.hits, prog->acl_cache_stats.misses);
+			if (args)
+				blobmsg_add_string(args, "ubus_rpc_session", sid);
+			return defer_callback(r, ctx, e->allow);
+		}
+
+		++prog->acl_cache_stats.misses;
+		r->cache_result = true;
+	}
+
+	// e.g. an event heard by several subscriptions of same session; have
+	// only one of them ask rpcd and the others wait for its answer
+	struct wsubus_access_check_req *leader = key ? acl_inflight_find(key) : NULL;
+	if (leader) {
+		free(key);
+		lwsl_debug("access check %s %s joins one in flight\n", object, method);
+		if (args)
+			blobmsg_add_string(args, "ubus_rpc_session", sid);
+		r->tag = REQ_TAG_WAIT;
+		list_add_tail(&r->wl, &leader->waiters);
+		return 0;
+	}
+
+	r->cache_entry = key;
 
-	// look up ubus object names "session"
-	if (ubus_lookup_id(ubus_ctx, "session", &access_id) != UBUS_STATUS_OK) {
+	struct ubus_context *ubus_ctx = prog->ubus_ctx;
+
+	// look up ubus object names "session", its id is cached
+	if (wsu_ubus_id_lookup(ubus_ctx, "session", &r->access_id) != UBUS_STATUS_OK) {
 		goto fail;
 	}
 
-	// construct call
-	struct blob_buf blob_for_access = {};
-	blob_buf_init(&blob_for_access, 0);
+	// construct call, kept in case it has to be repeated
+	struct blob_buf *blob_for_access = &r->access_blob;
+	blob_buf_init(blob_for_access, 0);
 
-	blobmsg_add_string(&blob_for_access, "ubus_rpc_session", sid);
-	blobmsg_add_string(&blob_for_access, "object", object);
+	blobmsg_add_string(blob_for_access, "ubus_rpc_session", sid);
+	blobmsg_add_string(blob_for_access, "object", object);
 	if (method)
-		blobmsg_add_string(&blob_for_access, "function", method);
+		blobmsg_add_string(blob_for_access, "function", method);
 	if (scope)
-		blobmsg_add_string(&blob_for_access, "scope", scope);
+		blobmsg_add_string(blob_for_access, "scope", scope);
 	if (args) {
 		blobmsg_add_string(args, "ubus_rpc_session", sid);
 		// we give the session object parameters "params" in hope some day
 		// session object will actually be able to check arguments and not just
 		// object/method names
-		blobmsg_add_field(&blob_for_access, BLOBMSG_TYPE_TABLE, "params", blobmsg_data(args->head), blobmsg_len(args->head));
+		blobmsg_add_field(blob_for_access, BLOBMSG_TYPE_TABLE, "params", blobmsg_data(args->head), blobmsg_len(args->head));
 	}
 
-	ret = ubus_invoke_async(ubus_ctx, access_id, "access", blob_for_access.head, &r->ubus_req);
-
-	if (ret != UBUS_STATUS_OK) {
+	if (wsubus_access_check__invoke(r, ubus_ctx) != UBUS_STATUS_OK) {
 		goto fail_mem_blob;
 	}
 
+	if (r->cache_entry)
+		list_add_tail(&r->wl, &acl_cache.inflight);
+
+	return 0;
+
+fail_mem_blob:
+	blob_buf_free(blob_for_access);
+fail:
+	return -1;
+}
+
+static int wsubus_access_check__invoke(struct wsubus_access_check_req *r, struct ubus_context *ubus_ctx)
+{
+	int ret = ubus_invoke_async(ubus_ctx, r->access_id, "access", r->access_blob.head, &r->ubus_req);
+
+	if (ret != UBUS_STATUS_OK)
+		return ret;
+
 	r->tag = REQ_TAG_UBUS;
 	r->ubus_req.data_cb = wsubus_access_check__on_ret;
 	r->ubus_req.complete_cb = wsubus_access_check__cb;
 
 	ubus_complete_request_async(ubus_ctx, &r->ubus_req);
+	return UBUS_STATUS_OK;
+}
 
-	blob_buf_free(&blob_for_access);
-
-	return 0;
+/**
+ * \brief check which others wait for is cancelled; first waiter takes over
+ * the pending call and asks rpcd again, on behalf of remaining ones
+ */
+static void wsubus_access_check__hand_over(struct ubus_context *ubus_ctx, struct wsubus_access_check_req *req)
+{
+	if (list_empty(&req->waiters))
+		return;
+
+	struct wsubus_access_check_req *w = list_first_entry(&req->waiters, struct wsubus_access_check_req, wl);
+	list_del(&w->wl);
+	INIT_LIST_HEAD(&w->waiters);
+	list_splice_init(&req->waiters, &w->waiters);
+
+	w->access_blob = req->access_blob;
+	memset(&req->access_blob, 0, sizeof req->access_blob);
+	w->access_id = req->access_id;
+	w->cache_entry = req->cache_entry;
+	req->cache_entry = NULL;
+	w->cache_result = req->cache_result;
+
+	if (wsubus_access_check__invoke(w, ubus_ctx) == UBUS_STATUS_OK) {
+		list_add_tail(&w->wl, &acl_cache.inflight);
+		return;
+	}
 
-fail_mem_blob:
-	blob_buf_free(&blob_for_access);
-fail:
-	return -1;
+	// could not ask, so no one gets access
+	blob_buf_free(&w->access_blob);
+	struct wsubus_access_check_req *o, *n;
+	list_for_each_entry_safe(o, n, &w->waiters, wl) {
+		list_del(&o->wl);
+		defer_callback(o, o->ctx, false);
+	}
+	defer_callback(w, w->ctx, false);
 }
 #endif // WSD_HAVE_UBUS
 
@@ -266,24 +653,16 @@ static int defer_callback(
 	return uloop_timeout_set(&req->defer_timer, 0);
 }
 
-int wsubus_access_check_(
-		struct wsubus_access_check_req *req,
+int wsubus_access_check_now(
 		struct lws *wsi,
 		const char *sid,
 		const char *scope,
 		const char *object,
 		const char *method,
-		struct blob_buf *args,
-		void *ctx,
-		wsubus_access_cb cb)
+		struct blob_buf *args)
 {
-	// this is the top-level entrypoint to access check, everything goes through it
-
 	const char *esid = wsu_sid_extended(sid);
 
-	req->cb = cb;
-	req->ctx = ctx;
-
 	enum wsu_ext_result res = EXT_CHECK_NEXT;
 	// first, check if one of 2 checkers whitelists this call
 	if (esid) {
@@ -298,21 +677,40 @@ int wsubus_access_check_(
 	}
 
 	// see if checker made a decision or if it says to consult next one
-	if (res != EXT_CHECK_NEXT) {
-		// the checker made a decision, schedule firing of callback
-		return defer_callback(req, ctx, res == EXT_CHECK_ALLOW);
+	if (res == EXT_CHECK_NEXT) {
+		// restrict calls only to some network interfaces
+		res = wsu_ext_restrict_interface(wsi, sid, scope, object, method, args);
 	}
 
-	// restrict calls only to some network interfaces
-	res = wsu_ext_restrict_interface(wsi, sid, scope, object, method, args);
-	if (res != EXT_CHECK_NEXT) {
-		return defer_callback(req, ctx, res == EXT_CHECK_ALLOW);
+	return res == EXT_CHECK_NEXT ? -1 : res == EXT_CHECK_ALLOW;
+}
+
+int wsubus_access_check_(
+		struct wsubus_access_check_req *req,
+		struct lws *wsi,
+		const char *sid,
+		const char *scope,
+		const char *object,
+		const char *method,
+		struct blob_buf *args,
+		void *ctx,
+		wsubus_access_cb cb)
+{
+	// this is the top-level entrypoint to access check, everything goes through it
+
+	req->cb = cb;
+	req->ctx = ctx;
+
+	int now = wsubus_access_check_now(wsi, sid, scope, object, method, args);
+	if (now >= 0) {
+		// the checker made a decision, schedule firing of callback
+		return defer_callback(req, ctx, now);
 	}
 
 	// by default, if no checker has made decision until now, ask rpcd about it (or allow if no ubus support)
 #if WSD_HAVE_UBUS
 	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
-	return wsubus_access_check_via_session(req, prog->ubus_ctx, sid, scope, object, method, args, ctx, cb);
+	return wsubus_access_check_via_session(req, prog, sid, scope, object, method, args, ctx, cb);
 #else
 	return EXT_CHECK_ALLOW;
 #endif
@@ -327,6 +725,15 @@ void wsubus_access_check__cancel(struct ubus_context *ubus_ctx, struct wsubus_ac
 #if WSD_HAVE_UBUS
 	case REQ_TAG_UBUS:
 		ubus_abort_request(ubus_ctx, &req->ubus_req);
+		if (req->cache_entry) {
+			list_del(&req->wl);
+			wsubus_access_check__hand_over(ubus_ctx, req);
+		}
+		break;
+	case REQ_TAG_WAIT:
+		list_del(&req->wl);
+		// so it can be cancelled again, or freed, without harm
+		req->tag = REQ_TAG_DEFER;
 		break;
 #endif
 	}
@@ -27,6 +27,7 @@
 struct lws;
 struct blob_buf;
 struct ubus_context;
+struct wsu_arena;
 
 /**
  * \brief structure representing access check in progress, opaque to callers
@@ -38,6 +39,12 @@ struct wsubus_access_check_req;
  */
 struct wsubus_access_check_req *wsubus_access_check_new(void);
 
+/**
+ * \brief creates a new access check request structure in the arena of the
+ * request it is done for. Freeing it is then left to the arena
+ */
+struct wsubus_access_check_req *wsubus_access_check_new_in(struct wsu_arena *arena);
+
 /**
  * \brief free the access check structure
  */
@@ -64,6 +71,32 @@ int wsubus_access_check_(
 		void *ctx,
 		wsubus_access_cb cb);
 
+/**
+ * \brief decide access right away if no one needs to be asked, e.g. for
+ * connections authenticated with TLS certificate
+ *
+ * @return 1 if allowed, 0 if denied, -1 if access check request has to be made
+ */
+int wsubus_access_check_now(
+		struct lws *wsi,
+		const char *sid,
+		const char *scope,
+		const char *object,
+		const char *method,
+		struct blob_buf *args);
+
+/**
+ * \brief find out if connection is authenticated with TLS client certificate,
+ * once, when it is established
+ */
+void wsubus_access_tls_init(struct lws *wsi);
+
+/**
+ * \brief forget cached access decisions for session, e.g. after its ACLs
+ * changed or it was destroyed
+ */
+void wsubus_access_cache_flush_sid(const char *sid);
+
 /**
  * \brief cancel an access check that is in progress
  */
@@ -98,6 +131,19 @@ static inline int wsubus_access_check__call(
 	return wsubus_access_check_(req, wsi, sid, NULL, object, method, args, ctx, cb);
 }
 
+/**
+ * \brief same as wsubus_access_check_now for RPC call
+ */
+static inline int wsubus_access_check_now__call(
+		struct lws *wsi,
+		const char *sid,
+		const char *object,
+		const char *method,
+		struct blob_buf *args)
+{
+	return wsubus_access_check_now(wsi, sid, NULL, object, method, args);
+}
+
 /**
  * \brief check if the given client with session id is allowed to be notified that a bus event happened
  *
@@ -127,3 +173,15 @@ static inline int wsubus_access_check__event(
 	// permissions.
 	return wsubus_access_check_(req, wsi, sid, "owsd", event, "read", data, ctx, cb);
 }
+
+/**
+ * \brief same as wsubus_access_check_now for event
+ */
+static inline int wsubus_access_check_now__event(
+		struct lws *wsi,
+		const char *sid,
+		const char *event,
+		struct blob_buf *data)
+{
+	return wsubus_access_check_now(wsi, sid, "owsd", event, "read", data);
+}
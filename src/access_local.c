@@ -0,0 +1,445 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * in-process evaluation of rpcd ACL files
+ */
+#include "access_local.h"
+#include "common.h"
+#include "util_ubus_ids.h"
+
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+#include <libubox/blobmsg_json.h>
+#include <libubox/list.h>
+#include <libubox/uloop.h>
+
+#include <sys/inotify.h>
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/** \brief wait this long (ms) after change in ACL dir for files to settle */
+#define ACCESS_LOCAL_RELOAD_DELAY 200
+
+enum {
+	ACL_PERM_READ,
+	ACL_PERM_WRITE,
+	__ACL_PERM_MAX
+};
+
+static const struct blobmsg_policy acl_perm_policy[__ACL_PERM_MAX] = {
+	[ACL_PERM_READ]  = { .name = "read",  .type = BLOBMSG_TYPE_TABLE },
+	[ACL_PERM_WRITE] = { .name = "write", .type = BLOBMSG_TYPE_TABLE },
+};
+
+/**
+ * \brief contents of one ACL file, groups point into it
+ */
+struct acl_file {
+	struct list_head list;
+	struct blob_attr *data;
+};
+
+/**
+ * \brief ACL group from a file, rules are per permission; scope name maps
+ * either to table of object patterns with lists of method patterns, or to
+ * list of object patterns for which the permission name is the method
+ */
+struct acl_group {
+	struct list_head list;
+	const char *name;
+	struct blob_attr *perms[__ACL_PERM_MAX];
+};
+
+/**
+ * \brief access groups rpcd granted to session
+ */
+struct acl_sid {
+	struct list_head list;
+
+	struct ubus_request req;
+	bool pending;
+
+	time_t expires;
+	// access-group table from session's ACLs, group name -> permissions
+	struct blob_attr *groups;
+
+	char sid[];
+};
+
+static struct {
+	bool enabled;
+	struct ubus_context *ubus_ctx;
+	const char *dir;
+
+	struct list_head files;
+	struct list_head groups;
+
+	// most recently used first
+	struct list_head sids;
+	unsigned int sid_count;
+
+	struct uloop_fd inotify;
+	struct uloop_timeout reload_timer;
+} acl_local;
+
+static time_t access_local_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+// ACL files {{{
+static void acl_file_load(const char *path, struct list_head *files, struct list_head *groups)
+{
+	struct blob_buf b = {};
+	blob_buf_init(&b, 0);
+
+	if (!blobmsg_add_json_from_file(&b, path)) {
+		lwsl_warn("could not parse ACL file %s\n", path);
+		goto out;
+	}
+
+	struct acl_file *f = malloc(sizeof *f);
+	if (!f)
+		goto out;
+	f->data = blob_memdup(b.head);
+	if (!f->data) {
+		free(f);
+		goto out;
+	}
+	list_add_tail(&f->list, files);
+
+	struct blob_attr *cur;
+	unsigned int rem;
+	blob_for_each_attr(cur, f->data, rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE)
+			continue;
+
+		struct acl_group *g = calloc(1, sizeof *g);
+		if (!g)
+			break;
+		g->name = blobmsg_name(cur);
+		blobmsg_parse(acl_perm_policy, __ACL_PERM_MAX, g->perms, blobmsg_data(cur), blobmsg_data_len(cur));
+		list_add_tail(&g->list, groups);
+	}
+
+out:
+	blob_buf_free(&b);
+}
+
+static void acl_local_free_rules(void)
+{
+	struct acl_group *g, *gn;
+	list_for_each_entry_safe(g, gn, &acl_local.groups, list) {
+		list_del(&g->list);
+		free(g);
+	}
+
+	struct acl_file *f, *fn;
+	list_for_each_entry_safe(f, fn, &acl_local.files, list) {
+		list_del(&f->list);
+		free(f->data);
+		free(f);
+	}
+}
+
+/**
+ * \brief (re)load all ACL files; groups of same name in several files all
+ * apply, as with rpcd
+ */
+static void acl_local_load(void)
+{
+	LIST_HEAD(files);
+	LIST_HEAD(groups);
+
+	char pattern[PATH_MAX];
+	snprintf(pattern, sizeof pattern, "%s/*.json", acl_local.dir);
+
+	glob_t gl;
+	if (glob(pattern, 0, NULL, &gl) == 0) {
+		for (size_t i = 0; i < gl.gl_pathc; ++i)
+			acl_file_load(gl.gl_pathv[i], &files, &groups);
+		globfree(&gl);
+	}
+
+	acl_local_free_rules();
+	list_splice(&files, &acl_local.files);
+	list_splice(&groups, &acl_local.groups);
+
+	unsigned int ngroups = 0;
+	struct acl_group *g;
+	list_for_each_entry(g, &acl_local.groups, list)
+		++ngroups;
+	lwsl_notice("loaded %u ACL groups from %s\n", ngroups, acl_local.dir);
+}
+
+static void acl_local_reload_cb(struct uloop_timeout *t)
+{
+	acl_local_load();
+}
+
+static void acl_local_inotify_cb(struct uloop_fd *ufd, unsigned int events)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+	// what changed doesn't matter, all files are read again
+	while (read(ufd->fd, buf, sizeof buf) > 0)
+		;
+
+	// editors and package manager write files in several steps
+	uloop_timeout_set(&acl_local.reload_timer, ACCESS_LOCAL_RELOAD_DELAY);
+}
+
+static bool acl_scope_allows(struct blob_attr *rules, int perm, const char *object, const char *method)
+{
+	struct blob_attr *o, *m;
+	unsigned int orem, mrem;
+
+	switch (blobmsg_type(rules)) {
+	case BLOBMSG_TYPE_TABLE:
+		blobmsg_for_each_attr(o, rules, orem) {
+			if (blobmsg_type(o) != BLOBMSG_TYPE_ARRAY || fnmatch(blobmsg_name(o), object, FNM_NOESCAPE))
+				continue;
+			blobmsg_for_each_attr(m, o, mrem) {
+				if (blobmsg_type(m) == BLOBMSG_TYPE_STRING && !fnmatch(blobmsg_get_string(m), method, FNM_NOESCAPE))
+					return true;
+			}
+		}
+		break;
+	case BLOBMSG_TYPE_ARRAY:
+		// e.g. uci configs, or owsd events; rpcd grants these with the
+		// permission as method
+		if (strcmp(method, acl_perm_policy[perm].name))
+			break;
+		blobmsg_for_each_attr(o, rules, orem) {
+			if (blobmsg_type(o) == BLOBMSG_TYPE_STRING && !fnmatch(blobmsg_get_string(o), object, FNM_NOESCAPE))
+				return true;
+		}
+		break;
+	}
+
+	return false;
+}
+
+static bool acl_group_allows(const char *name, int perm, const char *scope, const char *object, const char *method)
+{
+	struct acl_group *g;
+	list_for_each_entry(g, &acl_local.groups, list) {
+		if (!g->perms[perm] || strcmp(g->name, name))
+			continue;
+
+		struct blob_attr *cur;
+		unsigned int rem;
+		blobmsg_for_each_attr(cur, g->perms[perm], rem) {
+			if (!strcmp(blobmsg_name(cur), scope) && acl_scope_allows(cur, perm, object, method))
+				return true;
+		}
+	}
+	return false;
+}
+//}}}
+
+// session groups {{{
+static void acl_sid_drop(struct acl_sid *s)
+{
+	if (s->pending)
+		ubus_abort_request(acl_local.ubus_ctx, &s->req);
+	list_del(&s->list);
+	--acl_local.sid_count;
+	free(s->groups);
+	free(s);
+}
+
+static struct acl_sid *acl_sid_find(const char *sid)
+{
+	struct acl_sid *s;
+	list_for_each_entry(s, &acl_local.sids, list)
+		if (!strcmp(s->sid, sid))
+			return s;
+	return NULL;
+}
+
+static struct acl_sid *acl_sid_get(const char *sid)
+{
+	struct acl_sid *s = acl_sid_find(sid);
+	if (s) {
+		list_move(&s->list, &acl_local.sids);
+		return s;
+	}
+
+	if (acl_local.sid_count >= WSUBUS_ACCESS_LOCAL_MAX_SIDS)
+		acl_sid_drop(list_last_entry(&acl_local.sids, struct acl_sid, list));
+
+	s = calloc(1, sizeof *s + strlen(sid) + 1);
+	if (!s)
+		return NULL;
+	strcpy(s->sid, sid);
+	list_add(&s->list, &acl_local.sids);
+	++acl_local.sid_count;
+	return s;
+}
+
+static void acl_sid_on_list(struct ubus_request *req, int type, struct blob_attr *msg)
+{
+	struct acl_sid *s = container_of(req, struct acl_sid, req);
+
+	enum { SESSION_EXPIRES, SESSION_ACLS };
+	static const struct blobmsg_policy policy[] = {
+		[SESSION_EXPIRES] = { .name = "expires", .type = BLOBMSG_TYPE_INT32 },
+		[SESSION_ACLS]    = { .name = "acls",    .type = BLOBMSG_TYPE_TABLE },
+	};
+	struct blob_attr *tb[ARRAY_SIZE(policy)];
+
+	blobmsg_parse(policy, ARRAY_SIZE(policy), tb, blob_data(msg), blob_len(msg));
+
+	// session is not extended by deciding locally, so don't outlive it
+	if (tb[SESSION_EXPIRES] && blobmsg_get_u32(tb[SESSION_EXPIRES]) < WSUBUS_ACCESS_LOCAL_SID_TTL)
+		s->expires = access_local_now() + blobmsg_get_u32(tb[SESSION_EXPIRES]);
+
+	struct blob_attr *cur;
+	unsigned int rem;
+	blobmsg_for_each_attr(cur, tb[SESSION_ACLS], rem) {
+		if (blobmsg_type(cur) == BLOBMSG_TYPE_TABLE && !strcmp(blobmsg_name(cur), "access-group")) {
+			s->groups = blob_memdup(cur);
+			break;
+		}
+	}
+}
+
+static void acl_sid_on_done(struct ubus_request *req, int status)
+{
+	struct acl_sid *s = container_of(req, struct acl_sid, req);
+	s->pending = false;
+
+	if (status != UBUS_STATUS_OK) {
+		// no groups then, every check goes to rpcd until asked again
+		free(s->groups);
+		s->groups = NULL;
+	}
+	lwsl_debug("session %s groups %s\n", s->sid, s->groups ? "known" : "unknown");
+}
+
+static void acl_sid_fetch(struct acl_sid *s)
+{
+	uint32_t id;
+	if (wsu_ubus_id_lookup(acl_local.ubus_ctx, "session", &id) != UBUS_STATUS_OK)
+		return;
+
+	struct blob_buf b = {};
+	blob_buf_init(&b, 0);
+	blobmsg_add_string(&b, "ubus_rpc_session", s->sid);
+
+	free(s->groups);
+	s->groups = NULL;
+	// also when asking fails, not to ask again on every check
+	s->expires = access_local_now() + WSUBUS_ACCESS_LOCAL_SID_TTL;
+
+	if (ubus_invoke_async(acl_local.ubus_ctx, id, "list", b.head, &s->req) == UBUS_STATUS_OK) {
+		s->req.data_cb = acl_sid_on_list;
+		s->req.complete_cb = acl_sid_on_done;
+		s->pending = true;
+		ubus_complete_request_async(acl_local.ubus_ctx, &s->req);
+	}
+
+	blob_buf_free(&b);
+}
+
+void wsubus_access_local_flush_sid(const char *sid)
+{
+	if (!acl_local.enabled)
+		return;
+
+	struct acl_sid *s = acl_sid_find(sid);
+	if (s)
+		acl_sid_drop(s);
+}
+//}}}
+
+enum wsubus_access_local_result wsubus_access_local_check(
+		const char *sid,
+		const char *scope,
+		const char *object,
+		const char *method)
+{
+	if (!acl_local.enabled || !method)
+		return ACCESS_LOCAL_UNKNOWN;
+
+	struct acl_sid *s = acl_sid_get(sid);
+	if (!s || s->pending)
+		return ACCESS_LOCAL_UNKNOWN;
+
+	if (s->expires <= access_local_now()) {
+		acl_sid_fetch(s);
+		return ACCESS_LOCAL_UNKNOWN;
+	}
+
+	struct blob_attr *g, *p;
+	unsigned int grem, prem;
+	blobmsg_for_each_attr(g, s->groups, grem) {
+		blobmsg_for_each_attr(p, g, prem) {
+			if (blobmsg_type(p) != BLOBMSG_TYPE_STRING)
+				continue;
+			for (int perm = 0; perm < __ACL_PERM_MAX; ++perm) {
+				if (!strcmp(blobmsg_get_string(p), acl_perm_policy[perm].name) &&
+						acl_group_allows(blobmsg_name(g), perm, scope, object, method))
+					return ACCESS_LOCAL_ALLOW;
+			}
+		}
+	}
+
+	return ACCESS_LOCAL_DENY;
+}
+
+int wsubus_access_local_init(struct ubus_context *ctx, const char *dir)
+{
+	acl_local.ubus_ctx = ctx;
+	acl_local.dir = dir;
+	INIT_LIST_HEAD(&acl_local.files);
+	INIT_LIST_HEAD(&acl_local.groups);
+	INIT_LIST_HEAD(&acl_local.sids);
+
+	acl_local_load();
+	acl_local.enabled = true;
+
+	acl_local.reload_timer.cb = acl_local_reload_cb;
+	acl_local.inotify.cb = acl_local_inotify_cb;
+	acl_local.inotify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	if (acl_local.inotify.fd < 0 ||
+			inotify_add_watch(acl_local.inotify.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0 ||
+			uloop_fd_add(&acl_local.inotify, ULOOP_READ)) {
+		lwsl_err("can't watch ACL dir %s for changes: %s\n", dir, strerror(errno));
+		if (acl_local.inotify.fd >= 0)
+			close(acl_local.inotify.fd);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * in-process evaluation of rpcd ACL files
+ *
+ * Groups are read from rpcd's ACL JSON files (e.g. /usr/share/rpcd/acl.d/),
+ * and reloaded when the directory changes. rpcd is asked only once in a while
+ * which access groups a session was granted; access is then decided by
+ * matching against the group rules here, without round trip to rpcd for each
+ * check.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+struct ubus_context;
+
+/** \brief how long group membership of session is used before asking again */
+#define WSUBUS_ACCESS_LOCAL_SID_TTL 60
+
+/** \brief max number of sessions whose groups are kept */
+#define WSUBUS_ACCESS_LOCAL_MAX_SIDS 256
+
+enum wsubus_access_local_result {
+	ACCESS_LOCAL_UNKNOWN, // no decision, rpcd has to be asked
+	ACCESS_LOCAL_ALLOW,
+	ACCESS_LOCAL_DENY,
+};
+
+/**
+ * \brief load ACL files from directory, and start watching it for changes
+ *
+ * @return 0 if succeeded
+ */
+int wsubus_access_local_init(struct ubus_context *ctx, const char *dir);
+
+/**
+ * \brief decide access of session according to its access groups
+ *
+ * If groups of session are not known yet, they are asked for in background
+ * and unknown is returned. Deny is returned when no group rule matches,
+ * session could still have been granted access directly, not through a group.
+ *
+ * \param scope ubus, uci, owsd ...
+ */
+enum wsubus_access_local_result wsubus_access_local_check(
+		const char *sid,
+		const char *scope,
+		const char *object,
+		const char *method);
+
+/**
+ * \brief forget groups of session, after they were changed or session was
+ * destroyed
+ */
+void wsubus_access_local_flush_sid(const char *sid);
@@ -25,6 +25,17 @@
 #include <libubox/uloop.h>
 #include <stddef.h>
 
+/**
+ * \brief what to do when messages queued for writing exceed the budget
+ */
+enum wsd_write_q_policy {
+	WSD_WRITE_Q_DROP_EVENTS, // drop oldest event notifications to the peer, drop
+	                         // the connection if its replies alone are over
+	WSD_WRITE_Q_DROP_PEER,   // drop the connection
+	WSD_WRITE_Q_PAUSE,       // stop reading requests from peer until it catches
+	                         // up, events that don't fit are still dropped
+};
+
 struct prog_context {
 	struct uloop_fd **ufds;
 	size_t num_ufds;
@@ -43,6 +54,32 @@ struct prog_context {
 	const char *www_path;
 	const char *redir_from;
 	const char *redir_to;
+
+	// limits on bytes queued for writing, per connection and over all
+	size_t write_q_max;
+	size_t write_q_max_total;
+	enum wsd_write_q_policy write_q_policy;
+
+	size_t write_q_total;
+
+	// how many times each of the overflow measures was taken
+	struct {
+		unsigned long dropped_events;
+		unsigned long dropped_peers;
+		unsigned long paused_peers;
+	} write_q_stats;
+
+	// connections with permessage-deflate, each holding zlib streams, and
+	// how many of them are allowed
+	unsigned int deflate_peers;
+	unsigned int deflate_peers_max;
+
+	// how long rpcd access decisions are reused, in seconds, 0 disables it
+	unsigned int acl_cache_ttl;
+	struct {
+		unsigned long hits;
+		unsigned long misses;
+	} acl_cache_stats;
 };
 
 // each listen vhost keeps origin whitelist
@@ -50,6 +87,17 @@ struct vh_context {
 	struct list_head origins;
 	struct list_head users;
 	char *name;
+
+	// limits for data received from clients on this vhost
+	size_t max_msg_len;
+	size_t max_frame_len;
+
+	// permessage-deflate for ubus-json clients on this vhost
+	struct {
+		bool enabled;
+		int window_bits;
+		int mem_level;
+	} deflate;
 };
 struct str_list {
 	struct list_head list;
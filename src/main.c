@@ -28,15 +28,21 @@
 #include <dbus/dbus.h>
 #endif
 #if WSD_HAVE_UBUS
+#include "util_ubus_ids.h"
+#include "access_local.h"
 #include <libubus.h>
 #endif
 
 #include <libubox/uloop.h>
 #include <libwebsockets.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <locale.h>
+#include <signal.h>
 #include <sys/resource.h>
+#include <unistd.h>
 
 #ifndef WSD_DEF_UBUS_PATH
 #define WSD_DEF_UBUS_PATH "/var/run/ubus.sock"
@@ -50,6 +56,41 @@
 #define WSD_DEF_WWW_MAXAGE 0
 #endif
 
+#ifndef WSD_DEF_MAX_MSG_LEN
+#define WSD_DEF_MAX_MSG_LEN 134217728 // 128M
+#endif
+
+#ifndef WSD_DEF_MAX_FRAME_LEN
+#define WSD_DEF_MAX_FRAME_LEN WSD_DEF_MAX_MSG_LEN
+#endif
+
+#ifndef WSD_DEF_WRITE_Q_MAX
+#define WSD_DEF_WRITE_Q_MAX 1048576 // 1M
+#endif
+
+#ifndef WSD_DEF_WRITE_Q_MAX_TOTAL
+#define WSD_DEF_WRITE_Q_MAX_TOTAL 8388608 // 8M
+#endif
+
+#ifndef WSD_DEF_DEFLATE_WINDOW_BITS
+#define WSD_DEF_DEFLATE_WINDOW_BITS 12
+#endif
+
+#ifndef WSD_DEF_DEFLATE_MEM_LEVEL
+#define WSD_DEF_DEFLATE_MEM_LEVEL 5
+#endif
+
+#ifndef WSD_DEF_DEFLATE_PEERS_MAX
+#define WSD_DEF_DEFLATE_PEERS_MAX 64
+#endif
+
+#ifndef WSD_DEF_ACL_CACHE_TTL
+#define WSD_DEF_ACL_CACHE_TTL 10
+#endif
+
+#define WSD_STR_(x) #x
+#define WSD_STR(x) WSD_STR_(x)
+
 struct prog_context global;
 
 static void usage(char *name)
@@ -61,6 +102,16 @@ static void usage(char *name)
 			"  -w <www_path>    HTTP resources path [" WSD_DEF_WWW_PATH "]\n"
 			"  -t <www_maxage>  enable HTTP caching with specified max_age in seconds\n"
 			"  -r <from>:<to>   HTTP path redirect pair\n"
+			"  -q <bytes>       max bytes queued for writing per connection [" WSD_STR(WSD_DEF_WRITE_Q_MAX) "]\n"
+			"  -Q <bytes>       max bytes queued for writing in total [" WSD_STR(WSD_DEF_WRITE_Q_MAX_TOTAL) "]\n"
+			"  -O <policy>      when over write queue limit: drop-events, drop-peer or pause [drop-events]\n"
+#if WSD_HAVE_UBUS
+			"  -T <seconds>     reuse rpcd access decisions this long, 0 to disable [" WSD_STR(WSD_DEF_ACL_CACHE_TTL) "]\n"
+			"  -R <acl_dir>     decide access with rpcd ACL files from dir, e.g. /usr/share/rpcd/acl.d\n"
+#endif
+#ifndef LWS_NO_EXTENSIONS
+			"  -Z <count>       max connections using compression [" WSD_STR(WSD_DEF_DEFLATE_PEERS_MAX) "]\n"
+#endif // LWS_NO_EXTENSIONS
 #if WSD_HAVE_UBUSPROXY
 			"  -P <url> ...     URL of remote WS ubus to proxy as client\n"
 #ifdef LWS_OPENSSL_SUPPORT
@@ -76,6 +127,13 @@ static void usage(char *name)
 			"  -i <interface>   interface to bind to \n"
 			"  -o <origin> ...  origin url address to whitelist\n"
 			"  -u <user> ...    restrict login to this rpcd user\n"
+			"  -M <bytes>       max size of received message [" WSD_STR(WSD_DEF_MAX_MSG_LEN) "]\n"
+			"  -F <bytes>       max size of received frame [" WSD_STR(WSD_DEF_MAX_FRAME_LEN) "]\n"
+#ifndef LWS_NO_EXTENSIONS
+			"  -z               enable permessage-deflate for ubus-json [off]\n"
+			"  -W <bits>        deflate window bits, 9 to 15 [" WSD_STR(WSD_DEF_DEFLATE_WINDOW_BITS) "]\n"
+			"  -m <level>       deflate memory level, 1 to 9 [" WSD_STR(WSD_DEF_DEFLATE_MEM_LEVEL) "]\n"
+#endif // LWS_NO_EXTENSIONS
 #ifdef LWS_USE_IPV6
 			"  -6               enable IPv6, repeat to disable IPv4 [off]\n"
 #endif // LWS_USE_IPV6
@@ -85,6 +143,7 @@ static void usage(char *name)
 			"  -a <ca_file>     path to SSL CA file that makes clients trusted\n"
 #endif // LWS_OPENSSL_SUPPORT
 			"Options with ... are repeatable (e.g. -u one -u two ...)\n"
+			"SIGUSR1 logs statistics line starting with \"stats:\"\n"
 			"\n", name);
 }
 
@@ -96,12 +155,67 @@ void utimer_service(struct uloop_timeout *utimer)
 	uloop_timeout_set(utimer, 1000);
 }
 
+//{{{ statistics on SIGUSR1
+// signal handler only wakes up the loop through this pipe, stats are logged
+// from the loop
+static int stats_pipe[2] = { -1, -1 };
+
+static void stats_signal(int sig)
+{
+	(void)sig;
+	int saved_errno = errno;
+	if (write(stats_pipe[1], "", 1) < 0) {
+		// pipe is full, wakeup is pending already
+	}
+	errno = saved_errno;
+}
+
+static void stats_log(struct uloop_fd *ufd, unsigned int events)
+{
+	(void)events;
+	char buf[16];
+	while (read(ufd->fd, buf, sizeof buf) > 0)
+		;
+
+	lwsl_notice("stats: write_q_bytes %zu dropped_events %lu dropped_peers %lu paused_peers %lu"
+			" acl_cache_hits %lu acl_cache_misses %lu deflate_peers %u\n",
+			global.write_q_total,
+			global.write_q_stats.dropped_events,
+			global.write_q_stats.dropped_peers,
+			global.write_q_stats.paused_peers,
+			global.acl_cache_stats.hits,
+			global.acl_cache_stats.misses,
+			global.deflate_peers);
+}
+
+static struct uloop_fd stats_ufd = { .cb = stats_log };
+
+static int stats_init(void)
+{
+	if (pipe(stats_pipe))
+		return -1;
+
+	for (int i = 0; i < 2; ++i) {
+		fcntl(stats_pipe[i], F_SETFL, fcntl(stats_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(stats_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+
+	stats_ufd.fd = stats_pipe[0];
+	uloop_fd_add(&stats_ufd, ULOOP_READ);
+
+	struct sigaction sa = { .sa_handler = stats_signal, .sa_flags = SA_RESTART };
+	sigemptyset(&sa.sa_mask);
+	return sigaction(SIGUSR1, &sa, NULL);
+}
+//}}}
+
 int main(int argc, char *argv[])
 {
 	int rc = 0;
 
 #if WSD_HAVE_UBUS
 	const char *ubus_sock_path = WSD_DEF_UBUS_PATH;
+	const char *acl_dir = NULL;
 #endif
 	const char *www_dirpath = WSD_DEF_WWW_PATH;
 	int www_maxage = WSD_DEF_WWW_MAXAGE;
@@ -126,13 +240,22 @@ int main(int argc, char *argv[])
 	// FIXME to support different certs per different client, this becomes per-client
 #endif
 
+	global.write_q_max = WSD_DEF_WRITE_Q_MAX;
+	global.write_q_max_total = WSD_DEF_WRITE_Q_MAX_TOTAL;
+	global.write_q_policy = WSD_WRITE_Q_DROP_EVENTS;
+	global.deflate_peers_max = WSD_DEF_DEFLATE_PEERS_MAX;
+	global.acl_cache_ttl = WSD_DEF_ACL_CACHE_TTL;
+
 	int c;
 	while ((c = getopt(argc, argv,
 					/* global */
 #if WSD_HAVE_UBUS
-					"s:"
+					"s:T:R:"
+#endif
+					"w:t:r:q:Q:O:h"
+#ifndef LWS_NO_EXTENSIONS
+					"Z:"
 #endif
-					"w:t:r:h"
 
 					/* per-client */
 					"P:"
@@ -140,7 +263,10 @@ int main(int argc, char *argv[])
 					"C:K:A:"
 #endif
 					/* per-vhost */
-					"p:i:o:L:u:"
+					"p:i:o:L:u:M:F:"
+#ifndef LWS_NO_EXTENSIONS
+					"zW:m:"
+#endif
 #ifdef LWS_USE_IPV6
 					"6"
 #endif // LWS_USE_IPV6
@@ -153,6 +279,19 @@ int main(int argc, char *argv[])
 		case 's':
 			ubus_sock_path = optarg;
 			break;
+		case 'T': {
+			char *error;
+			unsigned long secs = strtoul(optarg, &error, 10);
+			if (*error) {
+				lwsl_err("Invalid TTL '%s' specified\n", optarg);
+				goto error;
+			}
+			global.acl_cache_ttl = secs;
+			break;
+		}
+		case 'R':
+			acl_dir = optarg;
+			break;
 #endif
 		case 'w':
 			www_dirpath = optarg;
@@ -167,6 +306,44 @@ int main(int argc, char *argv[])
 			www_maxage = secs;
 			break;
 		}
+		case 'q':
+		case 'Q': {
+			char *error;
+			unsigned long len = strtoul(optarg, &error, 10);
+			if (*error || !len) {
+				lwsl_err("Invalid length '%s' specified\n", optarg);
+				goto error;
+			}
+			if (c == 'q')
+				global.write_q_max = len;
+			else
+				global.write_q_max_total = len;
+			break;
+		}
+		case 'O':
+			if (!strcmp(optarg, "drop-events")) {
+				global.write_q_policy = WSD_WRITE_Q_DROP_EVENTS;
+			} else if (!strcmp(optarg, "drop-peer")) {
+				global.write_q_policy = WSD_WRITE_Q_DROP_PEER;
+			} else if (!strcmp(optarg, "pause")) {
+				global.write_q_policy = WSD_WRITE_Q_PAUSE;
+			} else {
+				lwsl_err("Invalid write queue policy '%s' specified\n", optarg);
+				goto error;
+			}
+			break;
+#ifndef LWS_NO_EXTENSIONS
+		case 'Z': {
+			char *error;
+			unsigned long count = strtoul(optarg, &error, 10);
+			if (*error) {
+				lwsl_err("Invalid count '%s' specified\n", optarg);
+				goto error;
+			}
+			global.deflate_peers_max = count;
+			break;
+		}
+#endif // LWS_NO_EXTENSIONS
 		case 'r':
 			redir_to = strchr(optarg, ':');
 			if (!redir_to) {
@@ -237,6 +414,10 @@ int main(int argc, char *argv[])
 			INIT_LIST_HEAD(&newvh->vh_ctx.origins);
 			INIT_LIST_HEAD(&newvh->vh_ctx.users);
 			newvh->vh_ctx.name = "";
+			newvh->vh_ctx.max_msg_len = WSD_DEF_MAX_MSG_LEN;
+			newvh->vh_ctx.max_frame_len = WSD_DEF_MAX_FRAME_LEN;
+			newvh->vh_ctx.deflate.window_bits = WSD_DEF_DEFLATE_WINDOW_BITS;
+			newvh->vh_ctx.deflate.mem_level = WSD_DEF_DEFLATE_MEM_LEVEL;
 			newvh->vh_info.options |= LWS_SERVER_OPTION_DISABLE_IPV6;
 
 			char *error;
@@ -277,6 +458,39 @@ int main(int argc, char *argv[])
 		case 'L':
 			currvh->vh_ctx.name = optarg;
 			break;
+		case 'M':
+		case 'F': {
+			char *error;
+			unsigned long len = strtoul(optarg, &error, 10);
+			if (*error || !len) {
+				lwsl_err("Invalid length '%s' specified\n", optarg);
+				goto error;
+			}
+			if (c == 'M')
+				currvh->vh_ctx.max_msg_len = len;
+			else
+				currvh->vh_ctx.max_frame_len = len;
+			break;
+		}
+#ifndef LWS_NO_EXTENSIONS
+		case 'z':
+			currvh->vh_ctx.deflate.enabled = true;
+			break;
+		case 'W':
+		case 'm': {
+			char *error;
+			long val = strtol(optarg, &error, 10);
+			if (*error || (c == 'W' ? val < 9 || val > 15 : val < 1 || val > 9)) {
+				lwsl_err("Invalid deflate %s '%s' specified\n", c == 'W' ? "window bits" : "memory level", optarg);
+				goto error;
+			}
+			if (c == 'W')
+				currvh->vh_ctx.deflate.window_bits = val;
+			else
+				currvh->vh_ctx.deflate.mem_level = val;
+			break;
+		}
+#endif // LWS_NO_EXTENSIONS
 #ifdef LWS_USE_IPV6
 		case '6':
 			if (currvh->vh_info.options & LWS_SERVER_OPTION_DISABLE_IPV6) {
@@ -317,6 +531,9 @@ ssl:
 
 	uloop_init();
 
+	if (stats_init())
+		lwsl_warn("stats will not be logged on SIGUSR1\n");
+
 	// connect to bus(es)
 
 #if WSD_HAVE_UBUS
@@ -328,6 +545,9 @@ ssl:
 	}
 	global.ubus_ctx = ubus_ctx;
 	ubus_add_uloop(ubus_ctx);
+	wsu_ubus_ids_init(ubus_ctx);
+	if (acl_dir && wsubus_access_local_init(ubus_ctx, acl_dir))
+		lwsl_warn("ACL files from %s will not be reloaded on change\n", acl_dir);
 #endif
 
 #if WSD_HAVE_DBUS
@@ -392,6 +612,7 @@ ssl:
 	struct lws_protocols ws_protocols[] = {
 		ws_http_proto,
 		wsubus_proto,
+		wsubus_blob_proto,
 		{ }
 	};
 
@@ -410,10 +631,23 @@ ssl:
 	wwwmount.mountpoint_len = strlen(wwwmount.mountpoint);
 	wwwmount.origin_protocol = LWSMPRO_FILE;
 
+#ifndef LWS_NO_EXTENSIONS
+	// offered to clients on vhosts which enable it, ubus-json peers take it,
+	// see wsubus_confirm_ext
+	static const struct lws_extension deflate_exts[] = {
+		{ "permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate; client_max_window_bits" },
+		{ NULL, NULL, NULL }
+	};
+#endif
+
 	// create all listening vhosts
 	for (struct vhinfo_list *c = currvh; c; c = c->next) {
 		c->vh_info.protocols = ws_protocols;
 		c->vh_info.mounts = &wwwmount;
+#ifndef LWS_NO_EXTENSIONS
+		if (c->vh_ctx.deflate.enabled)
+			c->vh_info.extensions = deflate_exts;
+#endif
 
 		// tell SSL clients to include their certificate but don't fail if they don't
 		if (c->vh_info.ssl_ca_filepath) {
@@ -431,11 +665,13 @@ ssl:
 			goto error_ubus_ufds_ctx;
 		}
 
-		// per-vhost storage is lws-allocated
-		struct vh_context **pvh_context = lws_protocol_vh_priv_zalloc(vh, &c->vh_info.protocols[1] /* ubus */, sizeof pvh_context);
+		// per-vhost storage is lws-allocated, both ubus protocols share it
+		for (int i = 1; i <= 2; ++i) {
+			struct vh_context **pvh_context = lws_protocol_vh_priv_zalloc(vh, &c->vh_info.protocols[i] /* ubus */, sizeof pvh_context);
 
-		// we allocate a pointer and point to per-vhost storage
-		*pvh_context = &c->vh_ctx;
+			// we allocate a pointer and point to per-vhost storage
+			*pvh_context = &c->vh_ctx;
+		}
 	}
 
 #if WSD_HAVE_UBUSPROXY
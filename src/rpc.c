@@ -23,16 +23,56 @@
  */
 #include "rpc.h"
 #include "util_jsonrpc.h"
-
-// FIXME RPCs should add themselves to list via macro / constructor magic,
-// instead of explicitly listing them to add them in list of supported RPCs
-#include "rpc_call.h"
-#include "rpc_list.h"
-#include "rpc_sub.h"
+#include "common.h"
+#include "util_arena.h"
 
 #include <libubox/blobmsg.h>
 #include <libubox/blobmsg_json.h>
 
+#include <stdint.h>
+
+// method table {{{
+/** \brief number of hash buckets, power of two; few methods exist so chains stay short */
+#define UBUSRPC_METHOD_BUCKETS 32
+
+static struct ubusrpc_method *method_table[UBUSRPC_METHOD_BUCKETS];
+
+/**
+ * \brief FNV-1a hash of method name
+ */
+static inline uint32_t method_hash(const char *name)
+{
+	uint32_t h = 2166136261u;
+	for (; *name; ++name) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct ubusrpc_method *method_lookup(const char *name)
+{
+	struct ubusrpc_method *m = method_table[method_hash(name) & (UBUSRPC_METHOD_BUCKETS - 1)];
+	for (; m; m = m->next)
+		if (!strcmp(m->name, name))
+			return m;
+	return NULL;
+}
+
+int ubusrpc_method_register(struct ubusrpc_method *method)
+{
+	if (method_lookup(method->name)) {
+		lwsl_err("RPC method %s registered twice\n", method->name);
+		return -1;
+	}
+
+	struct ubusrpc_method **bucket = &method_table[method_hash(method->name) & (UBUSRPC_METHOD_BUCKETS - 1)];
+	method->next = *bucket;
+	*bucket = method;
+	return 0;
+}
+//}}}
+
 int jsonrpc_blob_req_parse(struct jsonrpc_blob_req *req, const struct blob_attr *blob)
 {
 	enum { RPC_JSONRPC, RPC_ID, RPC_METHOD, RPC_PARAMS };
@@ -46,10 +86,10 @@ int jsonrpc_blob_req_parse(struct jsonrpc_blob_req *req, const struct blob_attr
 
 	struct blob_attr *tb[__RPC_MAX];
 
-	// TODO<blob> blob_(data|len) vs blobmsg_xxx usage, what is the difference
-	// and which is right here? (uhttpd ubus uses blob_.. for blob made with
-	// blobmsg_add_object and so do we)
-	blobmsg_parse(rpc_policy, __RPC_MAX, tb, blob_data(blob), blob_len(blob));
+	// blobmsg_data works both for root blob made with blob_buf_init(.., 0)
+	// (same as blob_data there) and for named table which is an element of
+	// batch request array (skips the blobmsg name header)
+	blobmsg_parse(rpc_policy, __RPC_MAX, tb, blobmsg_data(blob), (unsigned)blobmsg_data_len(blob));
 
 	// set ID always, we need to return it even if error in parsing other fields
 	req->id = tb[RPC_ID];
@@ -76,38 +116,31 @@ int jsonrpc_blob_req_parse(struct jsonrpc_blob_req *req, const struct blob_attr
 void ubusrpc_blob_destroy_default(struct ubusrpc_blob *ubusrpc_)
 {
 	free(ubusrpc_->src_blob);
-	free(ubusrpc_);
+	if (ubusrpc_->arena)
+		wsu_arena_free(ubusrpc_->arena);
+	else
+		free(ubusrpc_);
 }
 
-struct ubusrpc_blob* ubusrpc_blob_parse(const char *method, struct blob_attr *params_blob, enum jsonrpc_error_code *err)
+struct ubusrpc_blob* ubusrpc_blob_parse(const char *method, struct blob_attr *params_blob, size_t tailroom, enum jsonrpc_error_code *err)
 {
-	struct {
-		const char *name;
-		struct ubusrpc_blob* (*parse_func)(struct blob_attr *params_blob);
-		int (*handle_func)(struct lws *wsi, struct ubusrpc_blob *ubusrpc, struct blob_attr *id);
-	} supported_methods[] = {
-		{ "call", ubusrpc_blob_call_parse, ubusrpc_handle_call },
-		{ "list", ubusrpc_blob_list_parse, ubusrpc_handle_list },
-		{ "subscribe", ubusrpc_blob_sub_parse, ubusrpc_handle_sub },
-		{ "subscribe-list", ubusrpc_blob_sub_list_parse, ubusrpc_handle_sub_list },
-		{ "unsubscribe", ubusrpc_blob_sub_parse, ubusrpc_handle_unsub }, // parse is same as sub since args same
-	};
 	enum jsonrpc_error_code e;
 	struct ubusrpc_blob *ret;
-	for (unsigned long i = 0; i < ARRAY_SIZE(supported_methods); ++i)
-		if (!strcmp(supported_methods[i].name, method)) {
-			ret = supported_methods[i].parse_func(params_blob);
-			if (ret) {
-				e = JSONRPC_ERRORCODE__OK;
-				ret->handler = supported_methods[i].handle_func;
-			} else {
-				e = JSONRPC_ERRORCODE__INVALID_PARAMS;
-			}
-			goto out;
-		}
-
-	e = JSONRPC_ERRORCODE__METHOD_NOT_FOUND;
-	ret = NULL;
+	struct ubusrpc_method *m = method_lookup(method);
+
+	if (!m) {
+		e = JSONRPC_ERRORCODE__METHOD_NOT_FOUND;
+		ret = NULL;
+		goto out;
+	}
+
+	ret = m->parse_func(params_blob, tailroom);
+	if (ret) {
+		e = JSONRPC_ERRORCODE__OK;
+		ret->handler = m->handle_func;
+	} else {
+		e = JSONRPC_ERRORCODE__INVALID_PARAMS;
+	}
 
 out:
 	if (err)
@@ -37,6 +37,8 @@ struct jsonrpc_blob_req {
 };
 
 struct lws;
+struct wsu_batch;
+struct wsu_arena;
 
 /**
  * \brief Base structure for keeping track of asynchronous requests
@@ -44,6 +46,12 @@ struct lws;
 struct ws_request_base {
 	struct lws *wsi;
 
+	/**
+	 * \brief if request came as part of JSON-RPC batch, the reply is collected
+	 * here instead of being written right away. NULL otherwise
+	 */
+	struct wsu_batch *batch;
+
 	struct blob_attr *id;
 	struct blob_buf retbuf;
 
@@ -66,9 +74,23 @@ struct ws_request_base {
  * \brief base structure for storing parsed RPC arguments
  */
 struct ubusrpc_blob {
+	/**
+	 * \brief the received message which parsed data points into, set after
+	 * successful parse. Freed by ubusrpc_blob_destroy_default
+	 */
 	struct blob_attr *src_blob;
+
+	/**
+	 * \brief if set, this struct and everything for handling the request is
+	 * allocated from the arena, and freed along with it. Otherwise struct is
+	 * malloc'd
+	 */
+	struct wsu_arena *arena;
 	const char *sid;
 
+	/** \brief batch this RPC belongs to, or NULL, set before handler is called */
+	struct wsu_batch *batch;
+
 	/**
 	 * \brief parse for this RPC should fill in this pointer. When called, should execute the rpc and return 0
 	 */
@@ -84,6 +106,52 @@ struct ubusrpc_blob {
 
 void ubusrpc_blob_destroy_default(struct ubusrpc_blob *ubusrpc_);
 
+/**
+ * \brief describes one supported JSON-RPC method. RPC modules define these
+ * with UBUSRPC_METHOD, and they are added to method table at startup
+ */
+struct ubusrpc_method {
+	const char *name;
+
+	/** \brief parse params of this method, see ubusrpc_blob_parse */
+	struct ubusrpc_blob* (*parse_func)(struct blob_attr *params_blob, size_t tailroom);
+	/** \brief set as handler of successfully parsed RPC */
+	int (*handle_func)(struct lws *wsi, struct ubusrpc_blob *ubusrpc, struct blob_attr *id);
+
+	/** \brief next method in same hash bucket, owned by method table */
+	struct ubusrpc_method *next;
+};
+
+/**
+ * \brief add method to the table of supported methods
+ *
+ * Method struct is linked into the table, so it has to stay alive; name has
+ * to be unique.
+ *
+ * @return 0 on success, -1 if method with same name is already registered
+ */
+int ubusrpc_method_register(struct ubusrpc_method *method);
+
+/**
+ * \brief define an RPC method and register it before main() runs. Can be
+ * used in any linked-in source file, so new methods need no changes in rpc.c
+ *
+ * \param sym identifier unique within source file
+ * \param name_ JSON-RPC method name
+ * \param parse_ parse function, see ubusrpc_method::parse_func
+ * \param handle_ handler function, see ubusrpc_method::handle_func
+ */
+#define UBUSRPC_METHOD(sym, name_, parse_, handle_) \
+	static struct ubusrpc_method ubusrpc_method_##sym = { \
+		.name = name_, \
+		.parse_func = parse_, \
+		.handle_func = handle_, \
+	}; \
+	__attribute__((constructor)) static void ubusrpc_method_##sym##_register(void) \
+	{ \
+		ubusrpc_method_register(&ubusrpc_method_##sym); \
+	}
+
 /**
  * \brief parse a JSON-RPC request. Parses only the generic fields and leaves
  * RPC-specific stuff as blobs. returns 0 on success
@@ -95,12 +163,18 @@ int jsonrpc_blob_req_parse(struct jsonrpc_blob_req *req, const struct blob_attr
 
 /**
  * \brief depending on given JSONRPC method, calls appropriate parse callback
- * to parse the params blob and set up handler pointer
+ * to parse the params blob and set up handler pointer. Method is looked up in
+ * the table filled by UBUSRPC_METHOD definitions
+ *
+ * Parsed structure refers to data in params_blob, so the message has to be
+ * kept alive as its src_blob.
  *
  * \param method the RPC method name we are parsing
  * \param params_blob parameters of RPC method that we want to parse
+ * \param tailroom how many bytes right after params_blob are free to be
+ * written to, to append to params in place
  * \param err where to store error code if any
  *
  * @return Parsed structure with filled-in handler callback and parameter data, or NULL
  */
-struct ubusrpc_blob * ubusrpc_blob_parse(const char *method, struct blob_attr *params_blob, enum jsonrpc_error_code *err);
+struct ubusrpc_blob * ubusrpc_blob_parse(const char *method, struct blob_attr *params_blob, size_t tailroom, enum jsonrpc_error_code *err);
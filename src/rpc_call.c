@@ -27,6 +27,7 @@
 #include "wsubus.impl.h"
 #include "rpc.h"
 #include "access_check.h"
+#include "util_arena.h"
 
 #include <libubox/blobmsg.h>
 
@@ -40,7 +41,40 @@
 #include <assert.h>
 
 //parsing {{{
-int ubusrpc_blob_call_parse_(struct ubusrpc_blob_call *ubusrpc, struct blob_attr *blob)
+/**
+ * \brief grow callback for params buffer which owns its memory
+ */
+static bool params_buf_grow_owned(struct blob_buf *buf, int minlen)
+{
+	int delta = ((minlen / 256) + 1) * 256;
+	void *new = realloc(buf->buf, (size_t)(buf->buflen + delta));
+	if (!new)
+		return false;
+
+	buf->buf = new;
+	buf->buflen += delta;
+	return true;
+}
+
+/**
+ * \brief grow callback for params buffer still placed in the received
+ * message; not enough room left after it, so it moves to own memory
+ */
+static bool params_buf_grow_borrowed(struct blob_buf *buf, int minlen)
+{
+	int delta = ((minlen / 256) + 1) * 256;
+	void *new = malloc((size_t)(buf->buflen + delta));
+	if (!new)
+		return false;
+
+	memcpy(new, buf->buf, (size_t)buf->buflen);
+	buf->buf = new;
+	buf->buflen += delta;
+	buf->grow = params_buf_grow_owned;
+	return true;
+}
+
+int ubusrpc_blob_call_parse_(struct ubusrpc_blob_call *ubusrpc, struct blob_attr *blob, size_t tailroom)
 {
 	static const struct blobmsg_policy rpc_ubus_param_policy[] = {
 		[0] = { .type = BLOBMSG_TYPE_STRING }, // ubus-session id
@@ -51,87 +85,81 @@ int ubusrpc_blob_call_parse_(struct ubusrpc_blob_call *ubusrpc, struct blob_attr
 	enum { __RPC_U_MAX = (sizeof rpc_ubus_param_policy / sizeof rpc_ubus_param_policy[0]) };
 	struct blob_attr *tb[__RPC_U_MAX];
 
-	// we memdup the blob because params can outlive the jsonrpc blob through
-	// several callbacks
-	struct blob_attr *dup_blob = blob_memdup(blob);
-	if (!dup_blob) {
-		return -100;
-	}
-
-	struct blob_buf *params_buf = calloc(1, sizeof *params_buf);
-	if (!params_buf) {
-		free(dup_blob);
-		return -100;
-	}
-
 	// TODO<blob> blob_(data|len) vs blobmsg_xxx usage, what is the difference
 	// and which is right here? (uhttpd ubus uses blobmsg_data for blob which
 	// comes from another blob's table... here and so do we)
 	blobmsg_parse_array(rpc_ubus_param_policy, __RPC_U_MAX, tb,
-			blobmsg_data(dup_blob), (unsigned)blobmsg_len(dup_blob));
+			blobmsg_data(blob), (unsigned)blobmsg_len(blob));
 
-	int ret = 0;
 	for (int i = 0; i < (int)__RPC_U_MAX; ++i)
 		if (!tb[i])
-			ret = -i-1;
+			return -i-1;
 
-	if (ret)
-		goto out;
+	struct blob_attr *params = tb[3];
+	if (blobmsg_type(params) != BLOBMSG_TYPE_TABLE && blobmsg_type(params) != BLOBMSG_TYPE_ARRAY)
+		return -4;
 
+#if WSD_USER_BLACKLIST_OLD
 	unsigned int rem;
 	struct blob_attr *cur;
 
-#if WSD_USER_BLACKLIST_OLD
-	blobmsg_for_each_attr(cur, tb[3], rem) {
-		if (!strcmp("_owsd_listen", blobmsg_name(cur))) {
-			ret = -1;
-			goto out;
-		}
+	blobmsg_for_each_attr(cur, params, rem) {
+		if (!strcmp("_owsd_listen", blobmsg_name(cur)))
+			return -1;
 	}
 #endif
 
-	blob_buf_init(params_buf, 0);
+	// ubus wants the params as plain blob_attr whose payload are the
+	// arguments, while we have a named blobmsg table. Instead of copying the
+	// arguments, header for such attr is written over the name header of the
+	// table, which is always at least as long, right in front of the data.
+	unsigned int data_len = (unsigned)blobmsg_data_len(params);
+	struct blob_attr *head = (struct blob_attr *)((char *)blobmsg_data(params) - sizeof *head);
+	head->id_len = 0;
+	blob_set_raw_len(head, sizeof *head + data_len);
+
+	// Appending (see ubus_rpc_session, _owsd_listen) writes after the params
+	// data. That is free space only if table was the last thing in message,
+	// otherwise params are moved to own buffer on first append.
+	if ((char *)params + blob_pad_len(params) != (char *)blob + blob_pad_len(blob))
+		tailroom = 0;
+
+	ubusrpc->params_buf.head = head;
+	ubusrpc->params_buf.buf = head;
+	ubusrpc->params_buf.buflen = (int)(blob_pad_len(head) + tailroom);
+	ubusrpc->params_buf.grow = params_buf_grow_borrowed;
 
-	// Copied into via foreach because tb[3] when added to doesn't work vi aubus.
-	// This works but maybe we can do better without the loop (add whole params
-	// table at once), but how? (tried add_field add_blob ... <blob>???
-	// (blobmsg_add_blob works for id which comes from object, this comes from arr)
-	blobmsg_for_each_attr(cur, tb[3], rem)
-		blobmsg_add_blob(params_buf, cur);
-
-	ubusrpc->src_blob = dup_blob;
 	ubusrpc->sid = tb[0] ? blobmsg_get_string(tb[0]) : UBUS_DEFAULT_SID;
 	ubusrpc->object = blobmsg_get_string(tb[1]);
 	ubusrpc->method = blobmsg_get_string(tb[2]);
-	ubusrpc->params_buf = params_buf;
 
 	return 0;
-
-out:
-	free(dup_blob);
-	free(params_buf);
-	return ret;
 }
 
 static void ubusrpc_blob_call_destroy(struct ubusrpc_blob *ubusrpc_)
 {
 	struct ubusrpc_blob_call *ubusrpc = container_of(ubusrpc_, struct ubusrpc_blob_call, _base);
-	blob_buf_free(ubusrpc->params_buf);
-	free(ubusrpc->params_buf);
+	// until it had to grow, params buffer is part of src_blob
+	if (ubusrpc->params_buf.grow == params_buf_grow_owned)
+		blob_buf_free(&ubusrpc->params_buf);
 	ubusrpc_blob_destroy_default(&ubusrpc->_base);
 }
 
-struct ubusrpc_blob *ubusrpc_blob_call_parse(struct blob_attr *blob)
+struct ubusrpc_blob *ubusrpc_blob_call_parse(struct blob_attr *blob, size_t tailroom)
 {
-	struct ubusrpc_blob_call *ubusrpc = calloc(1, sizeof *ubusrpc);
-	if (!ubusrpc)
+	// the call context, ubus request and access check are later allocated
+	// from the same arena
+	struct wsu_arena *arena = wsu_arena_new(WSU_ARENA_DEFAULT_SIZE);
+	if (!arena)
 		return NULL;
 
-	if (ubusrpc_blob_call_parse_(ubusrpc, blob) != 0) {
-		free(ubusrpc);
+	struct ubusrpc_blob_call *ubusrpc = wsu_arena_zalloc(arena, sizeof *ubusrpc);
+	if (!ubusrpc || ubusrpc_blob_call_parse_(ubusrpc, blob, tailroom) != 0) {
+		wsu_arena_free(arena);
 		return NULL;
 	}
 
+	ubusrpc->arena = arena;
 	ubusrpc->destroy = ubusrpc_blob_call_destroy;
 
 	return &ubusrpc->_base;
@@ -158,3 +186,5 @@ int ubusrpc_handle_call(struct lws *wsi, struct ubusrpc_blob *ubusrpc_blob, stru
 
 	return ret;
 }
+
+UBUSRPC_METHOD(call, "call", ubusrpc_blob_call_parse, ubusrpc_handle_call)
@@ -33,13 +33,18 @@ struct ubusrpc_blob_call {
 
 	const char *object;
 	const char *method;
-	struct blob_buf *params_buf;
+
+	/**
+	 * \brief params to pass to ubus; head is placed in the received message
+	 * and appending to it is done in place while there is room
+	 */
+	struct blob_buf params_buf;
 };
 
 struct lws;
 struct ubusrpc_blob;
 struct list_head;
 
-struct ubusrpc_blob *ubusrpc_blob_call_parse(struct blob_attr *blob);
+struct ubusrpc_blob *ubusrpc_blob_call_parse(struct blob_attr *blob, size_t tailroom);
 
 int ubusrpc_handle_call(struct lws *wsi, struct ubusrpc_blob *ubusrpc_blob, struct blob_attr *id);
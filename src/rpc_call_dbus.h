@@ -27,6 +27,7 @@
 #include "util_dbus.h"
 #include "dubus_conversions.h"
 #include "common.h"
+#include "util_arena.h"
 
 #include <libubox/blobmsg.h>
 #include <dbus/dbus.h>
@@ -46,12 +47,11 @@ struct wsd_call_ctx {
 static void wsd_call_ctx_free(void *f)
 {
 	struct wsd_call_ctx *ctx = f;
-	free(ctx->id);
 
-	ctx->args->destroy(&ctx->args->_base);
 	blob_buf_free(&ctx->retbuf);
 
-	free(ctx);
+	// ctx is in the arena of args, id in their message
+	ctx->args->destroy(&ctx->args->_base);
 }
 
 static void wsd_call_ctx_cancel_and_destroy(struct ws_request_base *base)
@@ -76,9 +76,7 @@ static void wsd_call_cb(struct DBusPendingCall *call, void *data)
 	assert(reply);
 
 	if (!check_reply_and_make_error(reply, NULL, &ctx->retbuf)) {
-		char *response_str = jsonrpc__resp_error(ctx->id, JSONRPC_ERRORCODE__OTHER, blobmsg_data(ctx->retbuf.head));
-		wsu_queue_write_str(ctx->wsi, response_str);
-		free(response_str);
+		wsu_reply_error(ctx->wsi, ctx->batch, ctx->id, JSONRPC_ERRORCODE__OTHER, blobmsg_data(ctx->retbuf.head));
 		goto out;
 	}
 
@@ -94,9 +92,7 @@ static void wsd_call_cb(struct DBusPendingCall *call, void *data)
 
 	blobmsg_close_array(&ctx->retbuf, tkt);
 
-	char *response_str = jsonrpc__resp_ubus(ctx->id, 0, ctx->retbuf.head);
-	wsu_queue_write_str(ctx->wsi, response_str);
-	free(response_str);
+	wsu_reply_ubus(ctx->wsi, ctx->batch, ctx->id, 0, ctx->retbuf.head);
 out:
 	dbus_message_unref(reply);
 	ctx->call_req = NULL;
@@ -154,7 +150,7 @@ static int handle_call_dbus(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, stru
 	dbus_message_iter_init_append(msg, &arg_iter);
 	struct blob_attr *cur_arg;
 	unsigned int rem = 0;
-	blob_for_each_attr(cur_arg, ubusrpc_blob->params_buf->head, rem) {
+	blob_for_each_attr(cur_arg, ubusrpc_blob->params_buf.head, rem) {
 		int dbus_type = duconv_msg_ubus_to_dbus(&arg_iter, cur_arg, NULL);
 		if (dbus_type == DBUS_TYPE_INVALID) {
 			lwsl_warn("Can not convert argument name=%s type=%d for DBus call %s %s\n", blobmsg_name(cur_arg), blobmsg_type(cur_arg), ubusrpc_blob->object, ubusrpc_blob->method);
@@ -167,28 +163,28 @@ static int handle_call_dbus(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, stru
 		goto out2;
 	}
 
-	struct wsd_call_ctx *ctx = calloc(1, sizeof *ctx);
+	struct wsd_call_ctx *ctx = wsu_arena_zalloc(ubusrpc_blob->arena, sizeof *ctx);
 	if (!ctx) {
 		lwsl_err("OOM ctx\n");
 		goto out3;
 	}
 
 	ctx->wsi = wsi;
-	ctx->id = id ? blob_memdup(id) : NULL;
+	ctx->batch = ubusrpc_->batch;
+	ctx->id = id;
 	ctx->cancel_and_destroy = wsd_call_ctx_cancel_and_destroy;
 	ctx->call_req = call;
 	ctx->args = ubusrpc_blob;
-	if (id && !ctx->id) {
-		lwsl_err("OOM ctx id\n");
-		goto out4;
-	}
 
 	blob_buf_init(&ctx->retbuf, 0);
 	dbus_message_unref(msg);
 
 	if (!dbus_pending_call_set_notify(call, wsd_call_cb, ctx, NULL) || !call) {
 		lwsl_err("failed to set notify callback\n");
-		goto out5;
+		// msg is already released, ctx memory stays in args arena
+		blob_buf_free(&ctx->retbuf);
+		dbus_pending_call_unref(call);
+		goto out;
 	}
 	lwsl_debug("dbus-calling %p %p\n", call, ctx);
 
@@ -197,10 +193,6 @@ static int handle_call_dbus(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, stru
 
 	return 0;
 
-out5:
-	free(ctx->id);
-out4:
-	free(ctx);
 out3:
 	dbus_pending_call_unref(call);
 out2:
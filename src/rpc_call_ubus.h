@@ -23,6 +23,7 @@
 #include "wsubus.impl.h"
 #include "access_check.h"
 #include "common.h"
+#include "util_arena.h"
 
 #include <libubus.h>
 
@@ -36,23 +37,91 @@ struct wsubus_percall_ctx {
 	struct ubusrpc_blob_call *call_args;
 	struct ubus_request *invoke_req;
 	struct wsubus_client_access_check_ctx access_check;
+
+	bool got_data;
 };
 
+/**
+ * \brief big call result which is written out in fragments after the call is
+ * done, see wsu_stream. Takes over the buffer holding the result
+ */
+struct wsubus_call_stream {
+	struct wsu_stream stream;
+	struct blob_buf retbuf;
+	struct json_out_cursor cur;
+};
+
+static bool wsubus_call_stream_fill(struct wsu_stream *s)
+{
+	struct wsubus_call_stream *cs = container_of(s, struct wsubus_call_stream, stream);
+
+	if (!json_out_cursor_next(&cs->cur, &s->out, WSUBUS_STREAM_FRAG_LEN))
+		return false;
+
+	json_out_lit(&s->out, "]}");
+	return true;
+}
+
+static void wsubus_call_stream_destroy(struct wsu_stream *s)
+{
+	struct wsubus_call_stream *cs = container_of(s, struct wsubus_call_stream, stream);
+
+	blob_buf_free(&cs->retbuf);
+	free(cs);
+}
+
+/**
+ * \brief start sending OK reply with result in retbuf of the call as stream,
+ * if result is big enough and peer can take it
+ *
+ * @return 0 if reply was started
+ */
+static int wsubus_call_stream_reply(struct wsubus_percall_ctx *curr_call)
+{
+	struct blob_attr *data = blobmsg_len(curr_call->retbuf.head) ? blobmsg_data(curr_call->retbuf.head) : NULL;
+
+	if (!data || blob_len(data) < WSUBUS_STREAM_MIN_LEN || curr_call->batch || !wsu_stream_possible(curr_call->wsi))
+		return -1;
+
+	struct wsubus_call_stream *cs = malloc(sizeof *cs);
+	if (!cs)
+		return -1;
+
+	lwsl_info("streaming result of ubus call, %u bytes of blob\n", (unsigned)blob_len(data));
+
+	// result stays where it is, the buffer changes hands
+	cs->retbuf = curr_call->retbuf;
+	memset(&curr_call->retbuf, 0, sizeof curr_call->retbuf);
+	json_out_cursor_init(&cs->cur, data, blobmsg_type(data) == BLOBMSG_TYPE_ARRAY);
+
+	cs->stream.fill = wsubus_call_stream_fill;
+	cs->stream.destroy = wsubus_call_stream_destroy;
+	struct json_out *o = &cs->stream.out;
+	wsu_json_out_init(o);
+	wsu_json_resp_prefix(o, curr_call->id);
+	json_out_lit(o, ",\"result\":[0,");
+
+	if (wsu_stream_start(curr_call->wsi, &cs->stream)) {
+		// nothing went out, status is still replied
+		wsu_reply_ubus(curr_call->wsi, curr_call->batch, curr_call->id, UBUS_STATUS_UNKNOWN_ERROR, NULL);
+	}
+	return 0;
+}
+
 static void wsubus_percall_ctx_destroy(struct ws_request_base *base)
 {
 	struct wsubus_percall_ctx *call_ctx = container_of(base, struct wsubus_percall_ctx, _base);
-	free(call_ctx->id);
 
-	call_ctx->call_args->destroy(&call_ctx->call_args->_base);
 	blob_buf_free(&call_ctx->retbuf);
 
 	if (call_ctx->invoke_req) {
 		struct prog_context *prog = lws_context_user(lws_get_context(call_ctx->wsi));
 		ubus_abort_request(prog->ubus_ctx, call_ctx->invoke_req);
-		free(call_ctx->invoke_req);
 	}
 
-	free(call_ctx);
+	// everything else, including this ctx, is in the arena of call args and
+	// id is in their message, so this goes last and frees them in one go
+	call_ctx->call_args->destroy(&call_ctx->call_args->_base);
 }
 
 static struct wsubus_percall_ctx *wsubus_percall_ctx_create(
@@ -60,10 +129,14 @@ static struct wsubus_percall_ctx *wsubus_percall_ctx_create(
 		struct blob_attr *id,
 		struct ubusrpc_blob_call *call_args)
 {
-	struct wsubus_percall_ctx *ret = malloc(sizeof *ret);
+	struct wsubus_percall_ctx *ret = wsu_arena_alloc(call_args->arena, sizeof *ret);
+	if (!ret)
+		return NULL;
 
 	ret->wsi = wsi;
-	ret->id = id ? blob_memdup(id): NULL;
+	ret->batch = call_args->batch;
+	// id is in the message kept by call args, which outlive this ctx
+	ret->id = id;
 	memset(&ret->retbuf, 0, sizeof ret->retbuf);
 	blobmsg_buf_init(&ret->retbuf);
 	ret->cancel_and_destroy = wsubus_percall_ctx_destroy;
@@ -71,6 +144,7 @@ static struct wsubus_percall_ctx *wsubus_percall_ctx_create(
 	ret->call_args = call_args;
 	ret->invoke_req = NULL;
 	ret->access_check.req = NULL;
+	ret->got_data = false;
 
 	return ret;
 }
@@ -89,11 +163,18 @@ static void wsubus_call_on_completed(struct ubus_request *req, int status)
 	if (req->status_code != status)
 		lwsl_warn("status != req->status_code (%d != %d)\n", status, req->status_code);
 
-	char *json_str = jsonrpc__resp_ubus(curr_call->id, status, blobmsg_len(curr_call->retbuf.head) ? blobmsg_data(curr_call->retbuf.head) : NULL);
-
-	wsu_queue_write_str(curr_call->wsi, json_str);
-	free(json_str);
-	free(req);
+	// cached access decisions for the session no longer hold if its ACLs were
+	// changed or it is gone
+	if (!strcmp(curr_call->call_args->object, "session") &&
+			(!strcmp(curr_call->call_args->method, "grant") ||
+			 !strcmp(curr_call->call_args->method, "revoke") ||
+			 !strcmp(curr_call->call_args->method, "destroy")))
+		wsubus_access_cache_flush_sid(curr_call->call_args->sid);
+
+	// status is known by now, so big result is streamed only as part of OK
+	// reply, and any other goes out whole
+	if (status != UBUS_STATUS_OK || wsubus_call_stream_reply(curr_call))
+		wsu_reply_ubus(curr_call->wsi, curr_call->batch, curr_call->id, status, blobmsg_len(curr_call->retbuf.head) ? blobmsg_data(curr_call->retbuf.head) : NULL);
 	curr_call->invoke_req = NULL;
 
 	list_del(&curr_call->cq);
@@ -117,6 +198,13 @@ static void wsubus_call_on_retdata(struct ubus_request *req, int type, struct bl
 
 	struct wsubus_percall_ctx *curr_call = req->priv;
 
+	// only the first result goes into reply
+	if (curr_call->got_data) {
+		lwsl_debug("ignoring more data for ubus call %p\n", req);
+		return;
+	}
+	curr_call->got_data = true;
+
 	blobmsg_add_field(&curr_call->retbuf, blobmsg_type(msg), "", blobmsg_data(msg), blobmsg_data_len(msg));
 }
 
@@ -132,7 +220,7 @@ static int wsubus_call_do_call(struct wsubus_percall_ctx *curr_call)
 		goto out;
 	}
 
-	struct ubus_request *call_req = calloc(1, sizeof *call_req);
+	struct ubus_request *call_req = wsu_arena_zalloc(curr_call->call_args->arena, sizeof *call_req);
 	if (!call_req) {
 		lwsl_err("alloc ubus call req failed\n");
 		ret = UBUS_STATUS_UNKNOWN_ERROR;
@@ -142,16 +230,15 @@ static int wsubus_call_do_call(struct wsubus_percall_ctx *curr_call)
 #if WSD_USER_BLACKLIST_OLD
 	if (!strcmp(curr_call->call_args->sid, UBUS_DEFAULT_SID)) {
 		struct vh_context *vc = *(struct vh_context**)lws_protocol_vh_priv_get(lws_get_vhost(curr_call->wsi), lws_get_protocol(curr_call->wsi));
-		blobmsg_add_string(curr_call->call_args->params_buf, "_owsd_listen", vc->name);
+		blobmsg_add_string(&curr_call->call_args->params_buf, "_owsd_listen", vc->name);
 	}
 #endif
 
 	lwsl_info("ubus call request %p...\n", call_req);
-	ret = ubus_invoke_async(prog->ubus_ctx, object_id, curr_call->call_args->method, curr_call->call_args->params_buf->head, call_req);
+	ret = ubus_invoke_async(prog->ubus_ctx, object_id, curr_call->call_args->method, curr_call->call_args->params_buf.head, call_req);
 	if (ret != UBUS_STATUS_OK) {
 		lwsl_info("invoke failed: %s\n", ubus_strerror(ret));
-		// req will not free itself since will not complete so we dispose it
-		free(call_req);
+		// req memory stays in the arena until the call is destroyed
 		goto out;
 	}
 
@@ -191,9 +278,7 @@ out:
 	if (ret != UBUS_STATUS_OK) {
 		// hide all error codes in access behind permission denied
 		ret = UBUS_STATUS_PERMISSION_DENIED;
-		char *json_str = jsonrpc__resp_ubus(curr_call->id, ret, NULL);
-		wsu_queue_write_str(curr_call->wsi, json_str);
-		free(json_str);
+		wsu_reply_ubus(curr_call->wsi, curr_call->batch, curr_call->id, ret, NULL);
 
 		list_del(&curr_call->cq);
 		wsubus_percall_ctx_destroy(&curr_call->_base);
@@ -205,12 +290,18 @@ static int wsubus_call_do_check_then_do_call(struct wsubus_percall_ctx *curr_cal
 	struct wsu_client_session *client = wsi_to_client(curr_call->wsi);
 
 	int ret = 0;
+
+	// decided without asking, e.g. TLS certificate of connection
+	int now = wsubus_access_check_now__call(curr_call->wsi, curr_call->call_args->sid, curr_call->call_args->object, curr_call->call_args->method, &curr_call->call_args->params_buf);
+	if (now >= 0)
+		return now ? wsubus_call_do_call(curr_call) : UBUS_STATUS_PERMISSION_DENIED;
+
 	curr_call->access_check.destructor = NULL; // XXX
 
 	list_add_tail(&curr_call->access_check.acq, &client->access_check_q);
 
-	if ((curr_call->access_check.req = wsubus_access_check_new()))
-		ret = wsubus_access_check__call(curr_call->access_check.req, curr_call->wsi, curr_call->call_args->sid, curr_call->call_args->object, curr_call->call_args->method, curr_call->call_args->params_buf, curr_call, wsubus_access_on_completed);
+	if ((curr_call->access_check.req = wsubus_access_check_new_in(curr_call->call_args->arena)))
+		ret = wsubus_access_check__call(curr_call->access_check.req, curr_call->wsi, curr_call->call_args->sid, curr_call->call_args->object, curr_call->call_args->method, &curr_call->call_args->params_buf, curr_call, wsubus_access_on_completed);
 
 	if (!curr_call->access_check.req || ret) {
 		lwsl_warn("access check error\n");
@@ -246,6 +337,10 @@ int handle_call_ubus(struct lws *wsi, struct ubusrpc_blob *ubusrpc_blob, struct
 	}
 
 	curr_call = wsubus_percall_ctx_create(wsi, id, ubusrpc_req);
+	if (!curr_call) {
+		lwsl_err("alloc call ctx failed\n");
+		return -1;
+	}
 
 	list_add_tail(&curr_call->cq, &client->rpc_call_q);
 	ret = wsubus_call_do_check_then_do_call(curr_call);
@@ -254,14 +349,13 @@ int handle_call_ubus(struct lws *wsi, struct ubusrpc_blob *ubusrpc_blob, struct
 		// we hide the real error with access check
 		ret = UBUS_STATUS_PERMISSION_DENIED;
 
-		list_del(&curr_call->cq);
-		wsubus_percall_ctx_destroy(&curr_call->_base);
-
 		// invoke never happened, we need to send ubus error status
 		// (jsonrpc success, but ubus code != 0)
-		char *response = jsonrpc__resp_ubus(id, ret, NULL);
-		wsu_queue_write_str(wsi, response);
-		free(response);
+		// reply goes first, id points into the message owned by call args
+		wsu_reply_ubus(wsi, curr_call->batch, id, ret, NULL);
+
+		list_del(&curr_call->cq);
+		wsubus_percall_ctx_destroy(&curr_call->_base);
 	}
 
 	return 0; // means json-rpc went okay, we sent ubus error or rasponse here or in callback
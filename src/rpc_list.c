@@ -45,7 +45,6 @@
 static int ubusrpc_blob_list_parse_(struct ubusrpc_blob_list *ubusrpc, struct blob_attr *blob)
 {
 	if (blob_id(blob) != BLOBMSG_TYPE_ARRAY) {
-		ubusrpc->src_blob = NULL;
 		ubusrpc->pattern = NULL;
 		return 0;
 	}
@@ -57,30 +56,25 @@ static int ubusrpc_blob_list_parse_(struct ubusrpc_blob_list *ubusrpc, struct bl
 	enum { __RPC_U_MAX = (sizeof rpc_ubus_param_policy / sizeof rpc_ubus_param_policy[0]) };
 	struct blob_attr *tb[__RPC_U_MAX];
 
-	struct blob_attr *dup_blob = blob_memdup(blob);
-	if (!dup_blob) {
-		return -100;
-	}
-
 	// TODO<blob> blob_(data|len) vs blobmsg_xxx usage, what is the difference
 	// and which is right here? (uhttpd ubus uses blobmsg_data for blob which
 	// comes from another blob's table... here and so do we)
-	blobmsg_parse_array(rpc_ubus_param_policy, __RPC_U_MAX, tb, blobmsg_data(dup_blob), (unsigned)blobmsg_len(dup_blob));
+	blobmsg_parse_array(rpc_ubus_param_policy, __RPC_U_MAX, tb, blobmsg_data(blob), (unsigned)blobmsg_len(blob));
 
 	if (!tb[1]) {
-		free(dup_blob);
 		return -2;
 	}
 
-	ubusrpc->src_blob = dup_blob;
 	ubusrpc->sid = tb[0] ? blobmsg_get_string(tb[0]) : UBUS_DEFAULT_SID;
 	ubusrpc->pattern = blobmsg_get_string(tb[1]);
 
 	return 0;
 }
 
-struct ubusrpc_blob* ubusrpc_blob_list_parse(struct blob_attr *blob)
+struct ubusrpc_blob* ubusrpc_blob_list_parse(struct blob_attr *blob, size_t tailroom)
 {
+	(void)tailroom;
+
 	struct ubusrpc_blob_list *ubusrpc = calloc(1, sizeof *ubusrpc);
 	if (!ubusrpc)
 		return NULL;
@@ -109,6 +103,7 @@ int ubusrpc_handle_list(struct lws *wsi, struct ubusrpc_blob *ubusrpc, struct bl
 	// set up result blob buffer
 	req->id = blob_memdup(id);
 	req->wsi = wsi;
+	req->batch = ubusrpc->batch;
 	blob_buf_init(&req->retbuf, 0);
 
 #if WSD_HAVE_DBUS
@@ -131,3 +126,5 @@ int ubusrpc_handle_list(struct lws *wsi, struct ubusrpc_blob *ubusrpc, struct bl
 
 	return 0;
 }
+
+UBUSRPC_METHOD(list, "list", ubusrpc_blob_list_parse, ubusrpc_handle_list)
@@ -41,6 +41,6 @@ struct lws;
 /**
  * \brief parses json blob as list RPC and returns allocated parsed structure
  */
-struct ubusrpc_blob* ubusrpc_blob_list_parse(struct blob_attr *blob);
+struct ubusrpc_blob* ubusrpc_blob_list_parse(struct blob_attr *blob, size_t tailroom);
 
 int ubusrpc_handle_list(struct lws *wsi, struct ubusrpc_blob *ubusrpc, struct blob_attr *id);
@@ -100,9 +100,7 @@ static void introspect_list_next(struct wsd_list_ctx *ctx)
 
 static void introspect_list_finish(struct wsd_list_ctx *ctx)
 {
-	char *response_str = jsonrpc__resp_ubus(ctx->id, 0, ctx->retbuf.head);
-	wsu_queue_write_str(ctx->wsi, response_str);
-	free(response_str);
+	wsu_reply_ubus(ctx->wsi, ctx->batch, ctx->id, 0, ctx->retbuf.head);
 	list_del(&ctx->cq);
 	dbus_message_unref(ctx->list_reply);
 }
@@ -314,9 +312,7 @@ static void wsd_list_cb(DBusPendingCall *call, void *data)
 	dbus_message_set_data(ctx->list_reply, ctx->reply_slot, ctx, wsd_list_ctx_free);
 
 	if (!check_reply_and_make_error(reply, "as", &ctx->retbuf)) {
-		char *response_str = jsonrpc__resp_error(ctx->id, JSONRPC_ERRORCODE__OTHER, blobmsg_data(ctx->retbuf.head));
-		wsu_queue_write_str(ctx->wsi, response_str);
-		free(response_str);
+		wsu_reply_error(ctx->wsi, ctx->batch, ctx->id, JSONRPC_ERRORCODE__OTHER, blobmsg_data(ctx->retbuf.head));
 		dbus_message_unref(reply);
 		return;
 	}
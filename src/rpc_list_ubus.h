@@ -75,7 +75,6 @@ out:
 static int handle_list_ubus(struct ws_request_base *req, struct lws *wsi, struct ubusrpc_blob *ubusrpc_, struct blob_attr *id, bool output)
 {
 	struct ubusrpc_blob_list *ubusrpc = container_of(ubusrpc_, struct ubusrpc_blob_list, _base);
-	char *response_str;
 	int ret = 0;
 
 	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
@@ -85,16 +84,11 @@ static int handle_list_ubus(struct ws_request_base *req, struct lws *wsi, struct
 
 	if (output) {
 		if (ret) {
-			response_str = jsonrpc__resp_ubus(id, ret ? ret : -1, NULL);
+			wsu_reply_ubus(wsi, req->batch, id, ret ? ret : -1, NULL);
 		} else {
 			// using blobmsg_data here to pass only array part of blobmsg
-			response_str = jsonrpc__resp_ubus(id, 0, req->retbuf.head);
+			wsu_reply_ubus(wsi, req->batch, id, 0, req->retbuf.head);
 		}
-
-		wsu_queue_write_str(wsi, response_str);
-
-		// free memory
-		free(response_str);
 	}
 
 	return 0;
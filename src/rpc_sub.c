@@ -27,16 +27,18 @@
 #include "wsubus.impl.h"
 #include "rpc.h"
 #include "access_check.h"
+#include "util_ev_match.h"
 
 #include <libubox/blobmsg_json.h>
 #include <libubox/blobmsg.h>
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
 
 #if WSD_HAVE_UBUS
 #include <libubus.h>
 #endif
 
 #if WSD_HAVE_DBUS
-#include <fnmatch.h>
 #include <dbus/dbus.h>
 #include "dubus_conversions.h"
 #endif
@@ -44,16 +46,41 @@
 #include <libwebsockets.h>
 
 #include <assert.h>
+#include <time.h>
 
 /**
- * \brief subscriptions are kept in this list
+ * \brief distinct pattern subscribed to. For ubus it has event handler, to
+ * which ubusd sends event once, no matter how many subscriptions there are
+ * with the pattern. For DBus, it is looked up in index of patterns.
  */
-static LIST_HEAD(listen_list);
+struct ws_sub_pattern {
+	struct avl_node avl;
+#if WSD_HAVE_UBUS
+	struct ubus_event_handler ubus_handler;
+#endif
+#if WSD_HAVE_DBUS
+	struct wsu_ev_match_entry match;
+#endif
+	// subscriptions with this pattern, it goes away with the last one
+	struct list_head subs;
+	char pattern[];
+};
+
+/**
+ * \brief patterns, keyed by pattern
+ */
+static AVL_TREE(sub_patterns, avl_strcmp, false, NULL);
+
+#if WSD_HAVE_DBUS
+/**
+ * \brief index of patterns to match DBus signal names against
+ */
+static WSU_EV_MATCH(dbus_patterns);
+#endif
 
 /**
- * \brief When event happens, we find this struct. For ubus events, we find it
- * via container_of (1 handler per 1 subscription), while for DBus we find it
- * manually
+ * \brief When event happens, we find this struct in subscriptions of each
+ * matching pattern
  */
 struct ws_sub_info_ubus {
 	union {
@@ -62,16 +89,96 @@ struct ws_sub_info_ubus {
 	};
 
 	struct ubusrpc_blob_sub *sub;
-	struct list_head list;
-#if WSD_HAVE_UBUS
-	struct ubus_event_handler ubus_handler;
-#endif
+	// in subscriptions of client, by pattern
+	struct avl_node cavl;
+
+	struct ws_sub_pattern *pat;
+	struct list_head plist;
+
+	// state of the limits in sub->opts
+	struct {
+		// when last event went out, ms
+		int64_t last;
+		// when next event is due if they go out at max_rate, ms
+		int64_t tat;
+		// coalesced events waiting to go out, by type and in order of arrival
+		struct avl_tree pending;
+		struct list_head pending_order;
+		struct uloop_timeout timer;
+	} rate;
 };
 
+static void ws_sub_rate_init(struct ws_sub_info_ubus *info);
+static void ws_sub_rate_deinit(struct ws_sub_info_ubus *info);
+static void ws_sub_rate_reset(struct ws_sub_info_ubus *info);
+
 #if WSD_HAVE_UBUS
 static void wsubus_sub_cb(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type, struct blob_attr *msg);
 #endif
 
+/**
+ * \brief add subscription to its pattern, registering the pattern on ubus and
+ * in DBus index if this is the first one
+ */
+static int ws_sub_pattern_add(struct prog_context *prog, struct ws_sub_info_ubus *subinfo)
+{
+	const char *pattern = subinfo->sub->pattern;
+	struct ws_sub_pattern *pat = avl_find_element(&sub_patterns, pattern, pat, avl);
+
+	if (!pat) {
+		pat = calloc(1, sizeof *pat + strlen(pattern) + 1);
+		if (!pat)
+			return 9; // FIXME this is UBUS_STATUS_NO_DATA, should have our enum
+		strcpy(pat->pattern, pattern);
+		INIT_LIST_HEAD(&pat->subs);
+
+#if WSD_HAVE_UBUS
+		int ret = ubus_register_event_handler(prog->ubus_ctx, &pat->ubus_handler, pattern);
+		if (ret) {
+			lwsl_err("ubus reg evh error %s\n", ubus_strerror(ret));
+			free(pat);
+			return ret;
+		}
+		pat->ubus_handler.cb = wsubus_sub_cb;
+#endif
+
+#if WSD_HAVE_DBUS
+		wsu_ev_match_add(&dbus_patterns, &pat->match, pat->pattern);
+#endif
+
+		pat->avl.key = pat->pattern;
+		avl_insert(&sub_patterns, &pat->avl);
+		lwsl_info("listening for events %s\n", pattern);
+	}
+
+	subinfo->pat = pat;
+	list_add_tail(&subinfo->plist, &pat->subs);
+	return 0;
+}
+
+/**
+ * \brief remove subscription from its pattern, unregistering the pattern if
+ * it was the last one
+ */
+static void ws_sub_pattern_del(struct prog_context *prog, struct ws_sub_info_ubus *subinfo)
+{
+	struct ws_sub_pattern *pat = subinfo->pat;
+
+	list_del(&subinfo->plist);
+	if (!list_empty(&pat->subs))
+		return;
+
+	lwsl_info("no more listening for events %s\n", pat->pattern);
+#if WSD_HAVE_UBUS
+	ubus_unregister_event_handler(prog->ubus_ctx, &pat->ubus_handler);
+#endif
+#if WSD_HAVE_DBUS
+	wsu_ev_match_del(&dbus_patterns, &pat->match);
+#endif
+	avl_delete(&sub_patterns, &pat->avl);
+	free(pat);
+}
+
 #if WSD_HAVE_DBUS
 DBusHandlerResult ws_sub_cb_dbus(DBusConnection *bus, DBusMessage *msg, void *data);
 #endif
@@ -81,14 +188,13 @@ static void wsubus_unsub_elem(struct ws_request_base *elem_)
 	struct ws_sub_info_ubus *elem = container_of(elem_, struct ws_sub_info_ubus, _base);
 	struct prog_context *prog = lws_context_user(lws_get_context(elem->wsi));
 
-#if WSD_HAVE_UBUS
-	ubus_unregister_event_handler(prog->ubus_ctx, &elem->ubus_handler);
-#endif
+	ws_sub_pattern_del(prog, elem);
+	ws_sub_rate_deinit(elem);
 
-	list_del(&elem->list);
+	avl_delete(&wsi_to_client(elem->wsi)->subs, &elem->cavl);
 
 #if WSD_HAVE_DBUS
-	if (list_empty(&listen_list)) {
+	if (avl_is_empty(&sub_patterns)) {
 		dbus_bus_remove_match(prog->dbus_ctx, "type='signal'", NULL);
 		dbus_connection_remove_filter(prog->dbus_ctx, ws_sub_cb_dbus, NULL);
 	}
@@ -102,43 +208,129 @@ static void wsubus_unsub_elem(struct ws_request_base *elem_)
 	free(elem);
 }
 
+static bool ubusrpc_blob_sub_filter_valid(struct blob_attr *filter)
+{
+	struct blob_attr *cur;
+	unsigned int rem;
+
+	blobmsg_for_each_attr(cur, filter, rem) {
+		switch (blobmsg_type(cur)) {
+		case BLOBMSG_TYPE_STRING:
+		case BLOBMSG_TYPE_INT64:
+		case BLOBMSG_TYPE_INT32:
+		case BLOBMSG_TYPE_INT16:
+		case BLOBMSG_TYPE_INT8:
+		case BLOBMSG_TYPE_DOUBLE:
+			break;
+		case BLOBMSG_TYPE_TABLE: {
+			// only { "prefix": "..." }
+			struct blob_attr *p = blobmsg_data(cur);
+			if (blobmsg_data_len(cur) == 0
+					|| blob_pad_len(p) != blobmsg_data_len(cur)
+					|| blobmsg_type(p) != BLOBMSG_TYPE_STRING
+					|| strcmp(blobmsg_name(p), "prefix"))
+				return false;
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool ubusrpc_blob_sub_fields_valid(struct blob_attr *fields)
+{
+	struct blob_attr *cur;
+	unsigned int rem;
+
+	blobmsg_for_each_attr(cur, fields, rem) {
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_STRING)
+			return false;
+	}
+
+	return true;
+}
+
+static int ubusrpc_blob_sub_opts_parse(struct ubusrpc_sub_opts *opts, struct blob_attr *blob)
+{
+	enum { SUB_OPT_MIN_INTERVAL, SUB_OPT_MAX_RATE, SUB_OPT_COALESCE, SUB_OPT_FILTER, SUB_OPT_FIELDS, __SUB_OPT_MAX };
+	// types are checked below, so that option of wrong type is an error
+	// rather than ignored
+	static const struct blobmsg_policy policy[__SUB_OPT_MAX] = {
+		[SUB_OPT_MIN_INTERVAL] = { .name = "min_interval", .type = BLOBMSG_TYPE_UNSPEC },
+		[SUB_OPT_MAX_RATE]     = { .name = "max_rate",     .type = BLOBMSG_TYPE_UNSPEC },
+		[SUB_OPT_COALESCE]     = { .name = "coalesce",     .type = BLOBMSG_TYPE_UNSPEC },
+		[SUB_OPT_FILTER]       = { .name = "filter",       .type = BLOBMSG_TYPE_UNSPEC },
+		[SUB_OPT_FIELDS]       = { .name = "fields",       .type = BLOBMSG_TYPE_UNSPEC },
+	};
+	struct blob_attr *tb[__SUB_OPT_MAX];
+
+	blobmsg_parse(policy, __SUB_OPT_MAX, tb, blobmsg_data(blob), (unsigned)blobmsg_len(blob));
+
+	if ((tb[SUB_OPT_MIN_INTERVAL] && blobmsg_type(tb[SUB_OPT_MIN_INTERVAL]) != BLOBMSG_TYPE_INT32) ||
+			(tb[SUB_OPT_MAX_RATE] && blobmsg_type(tb[SUB_OPT_MAX_RATE]) != BLOBMSG_TYPE_INT32) ||
+			(tb[SUB_OPT_COALESCE] && blobmsg_type(tb[SUB_OPT_COALESCE]) != BLOBMSG_TYPE_BOOL))
+		return -1;
+
+	int32_t min_interval = tb[SUB_OPT_MIN_INTERVAL] ? (int32_t)blobmsg_get_u32(tb[SUB_OPT_MIN_INTERVAL]) : 0;
+	int32_t max_rate = tb[SUB_OPT_MAX_RATE] ? (int32_t)blobmsg_get_u32(tb[SUB_OPT_MAX_RATE]) : 0;
+	if (min_interval < 0 || max_rate < 0)
+		return -1;
+
+	opts->min_interval = min_interval;
+	opts->max_rate = max_rate;
+	opts->coalesce = tb[SUB_OPT_COALESCE] && blobmsg_get_bool(tb[SUB_OPT_COALESCE]);
+
+	if (tb[SUB_OPT_FILTER] && (blobmsg_type(tb[SUB_OPT_FILTER]) != BLOBMSG_TYPE_TABLE ||
+				!ubusrpc_blob_sub_filter_valid(tb[SUB_OPT_FILTER])))
+		return -1;
+	if (tb[SUB_OPT_FIELDS] && (blobmsg_type(tb[SUB_OPT_FIELDS]) != BLOBMSG_TYPE_ARRAY ||
+				!ubusrpc_blob_sub_fields_valid(tb[SUB_OPT_FIELDS])))
+		return -1;
+	opts->filter = tb[SUB_OPT_FILTER];
+	opts->fields = tb[SUB_OPT_FIELDS];
+	return 0;
+}
+
 static int ubusrpc_blob_sub_parse_(struct ubusrpc_blob_sub *ubusrpc, struct blob_attr *blob)
 {
 	static const struct blobmsg_policy rpc_ubus_param_policy[] = {
 		[0] = { .type = BLOBMSG_TYPE_STRING }, // ubus-session id
 		[1] = { .type = BLOBMSG_TYPE_STRING }, // ubus-object
+		[2] = { .type = BLOBMSG_TYPE_UNSPEC }, // options, optional table
 	};
 	enum { __RPC_U_MAX = (sizeof rpc_ubus_param_policy / sizeof rpc_ubus_param_policy[0]) };
 	struct blob_attr *tb[__RPC_U_MAX];
 
-	struct blob_attr *dup_blob = blob_memdup(blob);
-	if (!dup_blob) {
-		return -100;
-	}
-
 	// TODO<blob> blob_(data|len) vs blobmsg_xxx usage, what is the difference
 	// and which is right here? (uhttpd ubus uses blobmsg_data for blob which
 	// comes from another blob's table... here and so do we)
-	blobmsg_parse_array(rpc_ubus_param_policy, __RPC_U_MAX, tb, blobmsg_data(dup_blob), (unsigned)blobmsg_len(dup_blob));
+	blobmsg_parse_array(rpc_ubus_param_policy, __RPC_U_MAX, tb, blobmsg_data(blob), (unsigned)blobmsg_len(blob));
 
 	if (!tb[0]) {
-		free(dup_blob);
 		return -1;
 	}
 	if (!tb[1]) {
-		free(dup_blob);
 		return -2;
 	}
 
-	ubusrpc->src_blob = dup_blob;
 	ubusrpc->sid = tb[0] ? blobmsg_get_string(tb[0]) : UBUS_DEFAULT_SID;
 	ubusrpc->pattern = blobmsg_get_string(tb[1]);
 
+	if (tb[2] && (blobmsg_type(tb[2]) != BLOBMSG_TYPE_TABLE ||
+				ubusrpc_blob_sub_opts_parse(&ubusrpc->opts, tb[2]) != 0)) {
+		return -3;
+	}
+
 	return 0;
 }
 
-struct ubusrpc_blob* ubusrpc_blob_sub_parse(struct blob_attr *blob)
+struct ubusrpc_blob* ubusrpc_blob_sub_parse(struct blob_attr *blob, size_t tailroom)
 {
+	(void)tailroom;
+
 	struct ubusrpc_blob_sub *ubusrpc = calloc(1, sizeof *ubusrpc);
 	if (!ubusrpc)
 		return NULL;
@@ -167,14 +359,15 @@ int ubusrpc_blob_sub_list_parse_(struct ubusrpc_blob_sub *ubusrpc, struct blob_a
 	if (!tb[0])
 		return 2;
 
-	ubusrpc->src_blob = NULL;
 	ubusrpc->sid = tb[0] ? blobmsg_get_string(tb[0]) : UBUS_DEFAULT_SID;
 
 	return 0;
 }
 
-struct ubusrpc_blob* ubusrpc_blob_sub_list_parse(struct blob_attr *blob)
+struct ubusrpc_blob* ubusrpc_blob_sub_list_parse(struct blob_attr *blob, size_t tailroom)
 {
+	(void)tailroom;
+
 	struct ubusrpc_blob_sub *ubusrpc = calloc(1, sizeof *ubusrpc);
 	if (!ubusrpc)
 		return NULL;
@@ -194,6 +387,31 @@ int ubusrpc_handle_sub(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, struct bl
 	struct wsu_client_session *client = wsi_to_client(wsi);
 	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
 
+	// same subscription again would only get each event twice
+	struct ws_sub_info_ubus *dup;
+	for (dup = avl_find_element(&client->subs, ubusrpc->pattern, dup, cavl);
+			dup && &dup->cavl.list != &client->subs.list_head && !strcmp(dup->sub->pattern, ubusrpc->pattern);
+			dup = avl_next_element(dup, cavl)) {
+		if (!strcmp(dup->sub->sid, ubusrpc->sid)) {
+			lwsl_info("already subscribed to %s, options updated\n", ubusrpc->pattern);
+			// options point into the message, so new one replaces the old
+			struct ubusrpc_blob_sub *old = dup->sub;
+			dup->sub = ubusrpc;
+			dup->cavl.key = ubusrpc->pattern;
+			wsu_reply_ubus(wsi, ubusrpc->batch, id, 0, NULL);
+			// state kept under old limits doesn't apply to the new ones
+			if (old->opts.min_interval != ubusrpc->opts.min_interval ||
+					old->opts.max_rate != ubusrpc->opts.max_rate ||
+					old->opts.coalesce != ubusrpc->opts.coalesce)
+				ws_sub_rate_reset(dup);
+			if (old->destroy)
+				old->destroy(&old->_base);
+			else
+				ubusrpc_blob_destroy_default(&old->_base);
+			return 0;
+		}
+	}
+
 	// create entry
 	struct ws_sub_info_ubus *subinfo = malloc(sizeof *subinfo);
 	if (!subinfo) {
@@ -202,46 +420,39 @@ int ubusrpc_handle_sub(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, struct bl
 		goto out;
 	}
 
-#if WSD_HAVE_UBUS
-	// register handler on ubus
-	subinfo->ubus_handler = (struct ubus_event_handler){};
-	ret = ubus_register_event_handler(prog->ubus_ctx, &subinfo->ubus_handler, ubusrpc->pattern);
+	subinfo->id = NULL;
+	subinfo->sub = ubusrpc;
+	subinfo->wsi = wsi;
+	ws_sub_rate_init(subinfo);
+
+	__attribute__((unused)) bool first = avl_is_empty(&sub_patterns);
 
+	// share handler on ubus with other subscriptions of same pattern
+	ret = ws_sub_pattern_add(prog, subinfo);
 	if (ret) {
-		lwsl_err("ubus reg evh error %s\n", ubus_strerror(ret));
 		free(subinfo);
 		goto out;
 	}
 
-	subinfo->ubus_handler.cb = wsubus_sub_cb;
-#endif
-
-	subinfo->id = NULL;
-	subinfo->sub = ubusrpc;
-	// subinfo->ubus_handler inited above in ubus_register_...
-	subinfo->wsi = wsi;
-
 #if WSD_HAVE_DBUS
 	// turn on the global signal handler if this is first time we watch for events
-	if (list_empty(&listen_list)) {
+	if (first) {
 		dbus_bus_add_match(prog->dbus_ctx, "type='signal'", NULL);
 		dbus_connection_add_filter(prog->dbus_ctx, ws_sub_cb_dbus, NULL, NULL);
 	}
 #endif
 
-	// add entry to list
-	list_add_tail(&subinfo->list, &listen_list);
+	// add entry to client's subscriptions
+	subinfo->cavl.key = ubusrpc->pattern;
+	avl_insert(&client->subs, &subinfo->cavl);
 	list_add_tail(&subinfo->cq, &client->rpc_call_q);
 	subinfo->cancel_and_destroy = wsubus_unsub_elem;
 
 out:
-	if (ret) {
-		free(ubusrpc->src_blob);
-		ubusrpc->src_blob = NULL;
-	}
-	char *response = jsonrpc__resp_ubus(id, ret, NULL);
-	wsu_queue_write_str(wsi, response);
-	free(response);
+	// reply first, id is in the message which is freed with ubusrpc
+	wsu_reply_ubus(wsi, ubusrpc->batch, id, ret, NULL);
+	if (ret)
+		ubusrpc_blob_destroy_default(&ubusrpc->_base);
 
 	return 0;
 }
@@ -256,7 +467,454 @@ static void blobmsg_add_sub_info(struct blob_buf *buf, const char *name, const s
 	blobmsg_close_table(buf, tkt);
 }
 
+//{{{ event shared by subscribers
+/**
+ * \brief event as it goes out to subscribers. It is converted and serialized
+ * once, only the subscription info is made for each subscriber
+ */
+struct wsubus_event {
+	unsigned int refcount;
+
+	char *type;
+	// event data, made with blob_buf_init(.., 0)
+	struct blob_attr *data;
+
+	// JSON notification up to the subscription info, made when first needed
+	struct wsu_shared_buf *json;
+
+	// ubus events are checked against ACLs before they go out, DBus signals not
+	bool check_access;
+};
+
+static struct wsubus_event *wsubus_event_new(const char *type, struct blob_attr *data)
+{
+	struct wsubus_event *ev = malloc(sizeof *ev);
+	if (!ev)
+		return NULL;
+
+	ev->refcount = 1;
+	ev->type = strdup(type);
+	ev->data = blob_memdup(data);
+	ev->json = NULL;
+	ev->check_access = false;
+
+	if (!ev->type || !ev->data) {
+		free(ev->type);
+		free(ev->data);
+		free(ev);
+		return NULL;
+	}
+
+	return ev;
+}
+
+static struct wsubus_event *wsubus_event_get(struct wsubus_event *ev)
+{
+	++ev->refcount;
+	return ev;
+}
+
+static void wsubus_event_put(struct wsubus_event *ev)
+{
+	if (!ev || --ev->refcount)
+		return;
+
+	wsu_shared_buf_put(ev->json);
+	free(ev->type);
+	free(ev->data);
+	free(ev);
+}
+
+static struct wsu_shared_buf *wsubus_event_json(struct wsubus_event *ev)
+{
+	if (ev->json)
+		return ev->json;
+
+	struct json_out o;
+	wsu_shared_buf_json_out_init(&o);
+	json_out_lit(&o, "{\"jsonrpc\":\"2.0\",\"method\":\"event\",\"params\":{\"type\":");
+	json_out_string(&o, ev->type);
+	json_out_lit(&o, ",\"data\":");
+	json_out_container(&o, ev->data, false);
+	json_out_lit(&o, ",\"subscription\":");
+
+	return ev->json = wsu_shared_buf_from_json(&o);
+}
+
+/**
+ * \brief queue notification about event to the subscriber
+ */
+static void wsubus_event_notify(struct wsubus_event *ev, const struct ws_sub_info_ubus *info)
+{
+	lwsl_notice("notifying wsi %p \n", info->wsi);
+
+	if (wsi_to_peer(info->wsi)->binary) {
+		// blob lengths include the subscription info, so there is nothing to
+		// share, just the data is not converted again
+		struct blob_buf resp_buf = {};
+		blob_buf_init(&resp_buf, 0);
+		blobmsg_add_string(&resp_buf, "jsonrpc", "2.0");
+		blobmsg_add_string(&resp_buf, "method", "event");
+
+		void *tkt = blobmsg_open_table(&resp_buf, "params");
+		blobmsg_add_string(&resp_buf, "type", ev->type);
+		blobmsg_add_field(&resp_buf, BLOBMSG_TYPE_TABLE, "data", blobmsg_data(ev->data), blobmsg_len(ev->data));
+		blobmsg_add_sub_info(&resp_buf, "subscription", info);
+		blobmsg_close_table(&resp_buf, tkt);
+
+		wsu_queue_event(info->wsi, resp_buf.head);
+		blob_buf_free(&resp_buf);
+		return;
+	}
+
+	struct wsu_shared_buf *json = wsubus_event_json(ev);
+	if (!json) {
+		lwsl_err("failed to alloc event buf\n");
+		return;
+	}
+
+	struct json_out o;
+	wsu_json_out_init(&o);
+	json_out_lit(&o, "{\"pattern\":");
+	json_out_string(&o, info->sub->pattern);
+	json_out_lit(&o, ",\"ubus_rpc_session\":");
+	json_out_string(&o, info->sub->sid);
+	json_out_lit(&o, "}}}");
+
+	wsu_queue_event_shared(info->wsi, json, &o);
+}
+//}}}
+
+//{{{ payload filter and projection
+static struct blob_attr *ws_sub_data_field(struct blob_attr *data, const char *name)
+{
+	struct blob_attr *cur;
+	unsigned int rem;
+
+	blobmsg_for_each_attr(cur, data, rem) {
+		if (!strcmp(blobmsg_name(cur), name))
+			return cur;
+	}
+
+	return NULL;
+}
+
+static bool ws_sub_blobmsg_int(struct blob_attr *attr, int64_t *out)
+{
+	switch (blobmsg_type(attr)) {
+	case BLOBMSG_TYPE_INT64: *out = (int64_t)blobmsg_get_u64(attr); return true;
+	case BLOBMSG_TYPE_INT32: *out = (int32_t)blobmsg_get_u32(attr); return true;
+	case BLOBMSG_TYPE_INT16: *out = (int16_t)blobmsg_get_u16(attr); return true;
+	case BLOBMSG_TYPE_INT8:  *out = (int8_t)blobmsg_get_u8(attr); return true;
+	default: return false;
+	}
+}
+
+/**
+ * \brief whether field of event data matches value from filter
+ */
+static bool ws_sub_filter_value_match(struct blob_attr *want, struct blob_attr *have)
+{
+	if (blobmsg_type(want) == BLOBMSG_TYPE_TABLE) {
+		// { "prefix": "..." }, checked when parsed
+		const char *prefix = blobmsg_get_string(blobmsg_data(want));
+		return blobmsg_type(have) == BLOBMSG_TYPE_STRING
+			&& !strncmp(blobmsg_get_string(have), prefix, strlen(prefix));
+	}
+
+	// JSON numbers may come with differently sized integer types
+	int64_t a, b;
+	if (ws_sub_blobmsg_int(want, &a) && ws_sub_blobmsg_int(have, &b))
+		return a == b;
+
+	if (blobmsg_type(want) != blobmsg_type(have))
+		return false;
+
+	switch (blobmsg_type(want)) {
+	case BLOBMSG_TYPE_STRING:
+		return !strcmp(blobmsg_get_string(want), blobmsg_get_string(have));
+	case BLOBMSG_TYPE_DOUBLE:
+		return blobmsg_get_double(want) == blobmsg_get_double(have);
+	default:
+		return false;
+	}
+}
+
+static bool ws_sub_filter_match(const struct ubusrpc_sub_opts *opts, struct blob_attr *data)
+{
+	struct blob_attr *cur;
+	unsigned int rem;
+
+	blobmsg_for_each_attr(cur, opts->filter, rem) {
+		struct blob_attr *have = ws_sub_data_field(data, blobmsg_name(cur));
+		if (!have || !ws_sub_filter_value_match(cur, have))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * \brief event as this subscriber wants it, applying its filter and
+ * projection. Done before the event is checked for access or serialized, so
+ * unwanted events cost nothing more
+ *
+ * @return referenced event to be put by caller, NULL if subscriber doesn't
+ * want it
+ */
+static struct wsubus_event *ws_sub_event_select(const struct ws_sub_info_ubus *info, struct wsubus_event *ev)
+{
+	const struct ubusrpc_sub_opts *opts = &info->sub->opts;
+
+	if (opts->filter && !ws_sub_filter_match(opts, ev->data))
+		return NULL;
+
+	if (!opts->fields)
+		return wsubus_event_get(ev);
+
+	struct blob_buf b = {};
+	blob_buf_init(&b, 0);
+
+	struct blob_attr *cur, *f;
+	unsigned int rem, frem;
+	blobmsg_for_each_attr(cur, ev->data, rem) {
+		blobmsg_for_each_attr(f, opts->fields, frem) {
+			if (!strcmp(blobmsg_name(cur), blobmsg_get_string(f))) {
+				blob_put_raw(&b, cur, blob_pad_len(cur));
+				break;
+			}
+		}
+	}
+
+	struct wsubus_event *proj = wsubus_event_new(ev->type, b.head);
+	blob_buf_free(&b);
+	if (!proj) {
+		lwsl_err("alloc projected event error\n");
+		return NULL;
+	}
+
+	proj->check_access = ev->check_access;
+	return proj;
+}
+//}}}
+
+//{{{ rate limits
+#if WSD_HAVE_UBUS
+static void wsubus_sub_check_notify(struct wsubus_event *ev, struct ws_sub_info_ubus *info);
+#endif
+
+/**
+ * \brief coalesced event, latest of its type not yet sent to subscriber
+ */
+struct ws_sub_pending {
+	struct avl_node avl;
+	struct list_head list;
+	struct wsubus_event *ev;
+};
+
+static int64_t ws_sub_rate_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * \brief earliest time, in ms, when next event may go out. max_rate is
+ * enforced as generic cell rate algorithm, allowing burst of max_rate events
+ * over a second
+ */
+static int64_t ws_sub_rate_next(const struct ws_sub_info_ubus *info)
+{
+	const struct ubusrpc_sub_opts *opts = &info->sub->opts;
+	int64_t next = info->rate.last + opts->min_interval;
+
+	if (opts->max_rate) {
+		int64_t t = opts->max_rate < 1000 ? 1000 / opts->max_rate : 1;
+		if (info->rate.tat - (1000 - t) > next)
+			next = info->rate.tat - (1000 - t);
+	}
+
+	return next;
+}
+
+static void ws_sub_rate_sent(struct ws_sub_info_ubus *info, int64_t now)
+{
+	const struct ubusrpc_sub_opts *opts = &info->sub->opts;
+
+	info->rate.last = now;
+	if (opts->max_rate)
+		info->rate.tat = (info->rate.tat > now ? info->rate.tat : now)
+			+ (opts->max_rate < 1000 ? 1000 / opts->max_rate : 1);
+}
+
+static void ws_sub_deliver(struct wsubus_event *ev, struct ws_sub_info_ubus *info)
+{
+#if WSD_HAVE_UBUS
+	if (ev->check_access) {
+		wsubus_sub_check_notify(ev, info);
+		return;
+	}
+#endif
+	wsubus_event_notify(ev, info);
+}
+
+static void ws_sub_rate_timer_cb(struct uloop_timeout *timer)
+{
+	struct ws_sub_info_ubus *info = container_of(timer, struct ws_sub_info_ubus, rate.timer);
+	int64_t now = ws_sub_rate_now();
+
+	while (!list_empty(&info->rate.pending_order)) {
+		int64_t next = ws_sub_rate_next(info);
+		if (now < next) {
+			uloop_timeout_set(timer, (int)(next - now));
+			return;
+		}
+
+		struct ws_sub_pending *p = list_first_entry(&info->rate.pending_order, struct ws_sub_pending, list);
+		list_del(&p->list);
+		avl_delete(&info->rate.pending, &p->avl);
+
+		ws_sub_rate_sent(info, now);
+		ws_sub_deliver(p->ev, info);
+		wsubus_event_put(p->ev);
+		free(p);
+	}
+}
+
+static void ws_sub_rate_init(struct ws_sub_info_ubus *info)
+{
+	// so the first event is never held back by min_interval
+	info->rate.last = INT64_MIN / 2;
+	info->rate.tat = 0;
+	avl_init(&info->rate.pending, avl_strcmp, false, NULL);
+	INIT_LIST_HEAD(&info->rate.pending_order);
+	info->rate.timer = (struct uloop_timeout){ .cb = ws_sub_rate_timer_cb };
+}
+
+static void ws_sub_rate_deinit(struct ws_sub_info_ubus *info)
+{
+	uloop_timeout_cancel(&info->rate.timer);
+
+	struct ws_sub_pending *p, *tmp;
+	list_for_each_entry_safe(p, tmp, &info->rate.pending_order, list) {
+		wsubus_event_put(p->ev);
+		free(p);
+	}
+	INIT_LIST_HEAD(&info->rate.pending_order);
+	avl_init(&info->rate.pending, avl_strcmp, false, NULL);
+}
+
+/**
+ * \brief start over after limits were changed. Coalesced events go out now,
+ * so the latest values are not lost
+ */
+static void ws_sub_rate_reset(struct ws_sub_info_ubus *info)
+{
+	uloop_timeout_cancel(&info->rate.timer);
+
+	struct ws_sub_pending *p, *tmp;
+	list_for_each_entry_safe(p, tmp, &info->rate.pending_order, list) {
+		list_del(&p->list);
+		ws_sub_deliver(p->ev, info);
+		wsubus_event_put(p->ev);
+		free(p);
+	}
+
+	ws_sub_rate_init(info);
+}
+
+/**
+ * \brief apply subscriber's limits to the event, before it is checked and
+ * serialized for subscriber
+ *
+ * @return true if event may go out now. Otherwise event is dropped, or kept to
+ * go out later if subscriber asked for coalescing
+ */
+static bool ws_sub_rate_admit(struct ws_sub_info_ubus *info, struct wsubus_event *ev)
+{
+	const struct ubusrpc_sub_opts *opts = &info->sub->opts;
+	if (!opts->min_interval && !opts->max_rate)
+		return true;
+
+	int64_t now = ws_sub_rate_now();
+	int64_t next = ws_sub_rate_next(info);
+
+	// pending events are older, they go first
+	if (list_empty(&info->rate.pending_order) && now >= next) {
+		ws_sub_rate_sent(info, now);
+		return true;
+	}
+
+	if (!opts->coalesce)
+		return false;
+
+	struct ws_sub_pending *p = avl_find_element(&info->rate.pending, ev->type, p, avl);
+	if (p) {
+		// last value wins, but keeps the place of the first one
+		wsubus_event_put(p->ev);
+		p->ev = wsubus_event_get(ev);
+		p->avl.key = p->ev->type;
+		return false;
+	}
+
+	p = malloc(sizeof *p);
+	if (!p) {
+		lwsl_err("alloc pending event error\n");
+		return false;
+	}
+	p->ev = wsubus_event_get(ev);
+	p->avl.key = p->ev->type;
+	avl_insert(&info->rate.pending, &p->avl);
+	list_add_tail(&p->list, &info->rate.pending_order);
+
+	if (!info->rate.timer.pending)
+		uloop_timeout_set(&info->rate.timer, now < next ? (int)(next - now) : 0);
+
+	return false;
+}
+//}}}
+
 #if WSD_HAVE_DBUS
+struct ws_sub_dbus_signal {
+	DBusMessage *msg;
+	const char *type;
+	// converted when first matching pattern is found
+	struct wsubus_event *ev;
+};
+
+static void ws_sub_dbus_notify_pattern(struct wsu_ev_match_entry *e, void *ctx)
+{
+	struct ws_sub_pattern *pat = container_of(e, struct ws_sub_pattern, match);
+	struct ws_sub_dbus_signal *s = ctx;
+
+	if (!s->ev) {
+		// convert event name/data, once for all subscribers
+		struct duconv_convert c;
+		duconv_convert_init(&c, "arg%d");
+		DBusMessageIter iter;
+		dbus_message_iter_init(s->msg, &iter);
+		do {
+			duconv_msgiter_dbus_to_ubus_add_arg(&c, &iter, NULL);
+		} while (dbus_message_iter_next(&iter));
+		s->ev = wsubus_event_new(s->type, c.b.head);
+		duconv_convert_free(&c);
+
+		if (!s->ev) {
+			lwsl_err("alloc event error\n");
+			return;
+		}
+	}
+
+	struct ws_sub_info_ubus *elem;
+	list_for_each_entry(elem, &pat->subs, plist) {
+		struct wsubus_event *se = ws_sub_event_select(elem, s->ev);
+		if (se && ws_sub_rate_admit(elem, se))
+			wsubus_event_notify(se, elem);
+		wsubus_event_put(se);
+	}
+}
+
 /**
  * \brief called by libdbus when DBus signal (=event) happens
  */
@@ -268,49 +926,17 @@ DBusHandlerResult ws_sub_cb_dbus(DBusConnection *bus, DBusMessage *msg, void *da
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 	}
 
-	const char *type = dbus_message_get_member(msg);
-	lwsl_notice("dbus event %s happened\n", type);
+	struct ws_sub_dbus_signal s = {
+		.msg = msg,
+		.type = dbus_message_get_member(msg),
+		.ev = NULL,
+	};
+	lwsl_notice("dbus event %s happened\n", s.type);
 
-	// find matching entry in list
-	{
-		struct ws_sub_info_ubus *elem, *tmp;
-		list_for_each_entry_safe(elem, tmp, &listen_list, list) {
-			if (fnmatch(elem->sub->pattern, type, 0))
-				continue;
-
-			// prepare RPC event notification
-			struct blob_buf resp_buf = {};
-			blob_buf_init(&resp_buf, 0);
-			blobmsg_add_string(&resp_buf, "jsonrpc", "2.0");
-			blobmsg_add_string(&resp_buf, "method", "event");
-
-			lwsl_notice("notifying wsi %p \n", elem->wsi);
-
-			void *tkt = blobmsg_open_table(&resp_buf, "params");
-			blobmsg_add_string(&resp_buf, "type", type);
-
-			// convert event name/data
-			struct duconv_convert c;
-			duconv_convert_init(&c, "arg%d");
-			DBusMessageIter iter;
-			dbus_message_iter_init(msg, &iter);
-			do {
-				duconv_msgiter_dbus_to_ubus_add_arg(&c, &iter, NULL);
-			} while (dbus_message_iter_next(&iter));
-			blobmsg_add_field(&resp_buf, BLOBMSG_TYPE_TABLE, "data", blobmsg_data(c.b.head), blobmsg_len(c.b.head));
-			duconv_convert_free(&c);
-
-			blobmsg_add_sub_info(&resp_buf, "subscription", elem);
-			blobmsg_close_table(&resp_buf, tkt);
-
-			char *response = blobmsg_format_json(resp_buf.head, true);
-			blob_buf_free(&resp_buf);
-
-			wsu_queue_write_str(elem->wsi, response);
-			free(response);
-		}
-	}
+	// find matching patterns in index
+	wsu_ev_match_foreach(&dbus_patterns, s.type, ws_sub_dbus_notify_pattern, &s);
 
+	wsubus_event_put(s.ev);
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 #endif
@@ -318,32 +944,26 @@ DBusHandlerResult ws_sub_cb_dbus(DBusConnection *bus, DBusMessage *msg, void *da
 int ubusrpc_handle_sub_list(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, struct blob_attr *id)
 {
 	struct ubusrpc_blob_sub *ubusrpc = container_of(ubusrpc_, struct ubusrpc_blob_sub, _base);
-	char *response_str;
 	int ret = 0;
 
 	struct blob_buf sub_list_blob = {};
 	blob_buf_init(&sub_list_blob, 0);
 
 	void* array_ticket = blobmsg_open_array(&sub_list_blob, "");
-	struct ws_sub_info_ubus *elem, *tmp;
-	list_for_each_entry_safe(elem, tmp, &listen_list, list) {
-		if (elem->wsi == wsi)
-			blobmsg_add_sub_info(&sub_list_blob, "", elem);
-	}
+	struct ws_sub_info_ubus *elem;
+	avl_for_each_element(&wsi_to_client(wsi)->subs, elem, cavl)
+		blobmsg_add_sub_info(&sub_list_blob, "", elem);
 	blobmsg_close_array(&sub_list_blob, array_ticket);
 
 	if (ret) {
-		response_str = jsonrpc__resp_ubus(id, ret, NULL);
+		wsu_reply_ubus(wsi, ubusrpc->batch, id, ret, NULL);
 	} else {
 		// using blobmsg_data here to pass only array part of blobmsg
-		response_str = jsonrpc__resp_ubus(id, 0, blobmsg_data(sub_list_blob.head));
-		blob_buf_free(&sub_list_blob);
+		wsu_reply_ubus(wsi, ubusrpc->batch, id, 0, blobmsg_data(sub_list_blob.head));
 	}
 
-	wsu_queue_write_str(wsi, response_str);
-
 	// free memory
-	free(response_str);
+	blob_buf_free(&sub_list_blob);
 	free(ubusrpc->src_blob);
 	free(ubusrpc);
 	return 0;
@@ -352,30 +972,25 @@ int ubusrpc_handle_sub_list(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, stru
 int ubusrpc_handle_unsub(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, struct blob_attr *id)
 {
 	struct ubusrpc_blob_sub *ubusrpc = container_of(ubusrpc_, struct ubusrpc_blob_sub, _base);
-	char *response;
 	int ret = 0;
 
 	lwsl_debug("unsub %s ret = %d\n", ubusrpc->pattern, ret);
 
 	{
 		ret = 1;
-		struct ws_sub_info_ubus *elem, *tmp;
-		list_for_each_entry_safe(elem, tmp, &listen_list, list) {
-			// check pattern
-			if (elem->wsi == wsi && !strcmp(ubusrpc->pattern, elem->sub->pattern)) {
-				list_del(&elem->cq);
-				wsubus_unsub_elem(&elem->_base);
-				ret = 0;
-			}
+		struct ws_sub_info_ubus *elem;
+		// all of client's subscriptions with the pattern, whatever their sid
+		while ((elem = avl_find_element(&wsi_to_client(wsi)->subs, ubusrpc->pattern, elem, cavl))) {
+			list_del(&elem->cq);
+			wsubus_unsub_elem(&elem->_base);
+			ret = 0;
 		}
 	}
 
 	if (ret != 0)
 		ret = 5; // FIXME this is UBUS_STATUS_NOT_FOUND, should have our enum
 
-	response = jsonrpc__resp_ubus(id, ret, NULL);
-	wsu_queue_write_str(wsi, response);
-	free(response);
+	wsu_reply_ubus(wsi, ubusrpc->batch, id, ret, NULL);
 	free(ubusrpc->src_blob);
 	free(ubusrpc);
 
@@ -384,19 +999,52 @@ int ubusrpc_handle_unsub(struct lws *wsi, struct ubusrpc_blob *ubusrpc_, struct
 
 #if WSD_HAVE_UBUS
 struct wsubus_ev_notif {
-	char *type;
-	struct blob_attr *msg;
+	struct wsubus_event *ev;
 	struct ws_sub_info_ubus *info;
 	struct wsubus_client_access_check_ctx cr;
 };
 
 static void wsubus_ev_destroy_ctx(struct wsubus_ev_notif *t)
 {
-	free(t->type);
-	free(t->msg);
+	wsubus_event_put(t->ev);
 	free(t);
 }
 
+// event made by last handler call, kept until end of current loop iteration
+static struct wsubus_event *ev_last;
+
+static void wsubus_ev_last_drop(struct uloop_timeout *timer)
+{
+	(void)timer;
+	wsubus_event_put(ev_last);
+	ev_last = NULL;
+}
+
+static struct uloop_timeout ev_last_timer = { .cb = wsubus_ev_last_drop };
+
+/**
+ * \brief ubus sends event to handler of each matching pattern separately, one
+ * message right after another, so within one dispatch the event made last is
+ * reused if this one is the same. It is dropped once the messages read in
+ * this loop iteration are handled, so it is neither kept alive nor compared
+ * against later events
+ */
+static struct wsubus_event *wsubus_ev_get(const char *type, struct blob_attr *msg)
+{
+	if (ev_last && blob_raw_len(ev_last->data) == blob_raw_len(msg) && !strcmp(ev_last->type, type) &&
+			!memcmp(ev_last->data, msg, blob_raw_len(msg)))
+		return wsubus_event_get(ev_last);
+
+	wsubus_event_put(ev_last);
+	ev_last = wsubus_event_new(type, msg);
+	if (!ev_last)
+		return NULL;
+	ev_last->check_access = true;
+	// timeouts run before fds are polled again
+	uloop_timeout_set(&ev_last_timer, 0);
+	return wsubus_event_get(ev_last);
+}
+
 static void wsubus_ev_check__destroy(struct wsubus_client_access_check_ctx *cr)
 {
 	wsubus_ev_destroy_ctx(container_of(cr, struct wsubus_ev_notif, cr));
@@ -414,50 +1062,42 @@ static void wsubus_ev_check_cb(struct wsubus_access_check_req *req, void *ctx, b
 		goto out;
 	}
 
-	struct blob_buf resp_buf = {};
-	blob_buf_init(&resp_buf, 0);
-	blobmsg_add_string(&resp_buf, "jsonrpc", "2.0");
-	blobmsg_add_string(&resp_buf, "method", "event");
-
-	void *tkt = blobmsg_open_table(&resp_buf, "params");
-	blobmsg_add_string(&resp_buf, "type", t->type);
-	blobmsg_add_field(&resp_buf, BLOBMSG_TYPE_TABLE, "data", blobmsg_data(t->msg), blobmsg_len(t->msg));
-	blobmsg_add_sub_info(&resp_buf, "subscription", t->info);
-	blobmsg_close_table(&resp_buf, tkt);
-
-	char *response = blobmsg_format_json(resp_buf.head, true);
-	blob_buf_free(&resp_buf);
-
-	wsu_queue_write_str(t->info->wsi, response);
-	free(response);
+	wsubus_event_notify(t->ev, t->info);
 
 out:
 	list_del(&t->cr.acq);
 	wsubus_ev_destroy_ctx(t);
 }
 
-static void wsubus_sub_cb(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type, struct blob_attr *msg)
+/**
+ * \brief check if subscriber may hear the event, and notify it if so
+ */
+static void wsubus_sub_check_notify(struct wsubus_event *ev, struct ws_sub_info_ubus *info)
 {
-	__attribute__((unused)) int mtype = blobmsg_type(msg);
-	(void)ctx;
-	lwsl_debug("sub cb called, ev type %s, blob of len %d thpe %s\n", type, blobmsg_len(msg),
-			mtype == BLOBMSG_TYPE_STRING ? "\"\"" :
-			mtype == BLOBMSG_TYPE_TABLE ? "{}" :
-			mtype == BLOBMSG_TYPE_ARRAY ? "[]" : "<>");
-
-	struct ws_sub_info_ubus *info = container_of(ev, struct ws_sub_info_ubus, ubus_handler);
 	struct wsu_client_session *client = wsi_to_client(info->wsi);
 
+	// e.g. proxy links authenticated with TLS certificate need no asking,
+	// and their event stream doesn't need to wait for next loop iteration
+	int now = wsubus_access_check_now__event(info->wsi, info->sub->sid, ev->type, NULL);
+	if (now >= 0) {
+		if (now)
+			wsubus_event_notify(ev, info);
+		return;
+	}
+
 	struct wsubus_ev_notif *t = malloc(sizeof *t);
-	t->type = strdup(type);
-	t->msg = blob_memdup(msg);
+	if (!t) {
+		lwsl_err("alloc event error\n");
+		return;
+	}
+	t->ev = wsubus_event_get(ev);
 	t->info = info;
 	t->cr.destructor = wsubus_ev_check__destroy;
 	list_add_tail(&t->cr.acq, &client->access_check_q);
 
 	int err = 0;
 	if((t->cr.req = wsubus_access_check_new()))
-		err = wsubus_access_check__event(t->cr.req, info->wsi, info->sub->sid, t->type, NULL /* XXX */, t, wsubus_ev_check_cb);
+		err = wsubus_access_check__event(t->cr.req, info->wsi, info->sub->sid, t->ev->type, NULL /* XXX */, t, wsubus_ev_check_cb);
 
 	if (!t->cr.req || err) {
 		list_del(&t->cr.acq);
@@ -466,4 +1106,37 @@ static void wsubus_sub_cb(struct ubus_context *ctx, struct ubus_event_handler *e
 		return;
 	}
 }
+
+static void wsubus_sub_cb(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type, struct blob_attr *msg)
+{
+	__attribute__((unused)) int mtype = blobmsg_type(msg);
+	(void)ctx;
+	lwsl_debug("sub cb called, ev type %s, blob of len %d thpe %s\n", type, blobmsg_len(msg),
+			mtype == BLOBMSG_TYPE_STRING ? "\"\"" :
+			mtype == BLOBMSG_TYPE_TABLE ? "{}" :
+			mtype == BLOBMSG_TYPE_ARRAY ? "[]" : "<>");
+
+	struct ws_sub_pattern *pat = container_of(ev, struct ws_sub_pattern, ubus_handler);
+
+	struct wsubus_event *e = wsubus_ev_get(type, msg);
+	if (!e) {
+		lwsl_err("alloc event error\n");
+		return;
+	}
+
+	struct ws_sub_info_ubus *info;
+	list_for_each_entry(info, &pat->subs, plist) {
+		struct wsubus_event *se = ws_sub_event_select(info, e);
+		if (se && ws_sub_rate_admit(info, se))
+			wsubus_sub_check_notify(se, info);
+		wsubus_event_put(se);
+	}
+
+	wsubus_event_put(e);
+}
 #endif
+
+UBUSRPC_METHOD(sub, "subscribe", ubusrpc_blob_sub_parse, ubusrpc_handle_sub)
+UBUSRPC_METHOD(sub_list, "subscribe-list", ubusrpc_blob_sub_list_parse, ubusrpc_handle_sub_list)
+// parse is same as sub since args same
+UBUSRPC_METHOD(unsub, "unsubscribe", ubusrpc_blob_sub_parse, ubusrpc_handle_unsub)
@@ -23,9 +23,30 @@
  */
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 #include "rpc.h"
 
+/**
+ * \brief optional limits on which events subscriber gets and how often, 0 or
+ * NULL for no limit
+ */
+struct ubusrpc_sub_opts {
+	// least time between two events, in ms
+	unsigned int min_interval;
+	// most events in a second
+	unsigned int max_rate;
+	// over the limits, keep last event of each type to send later, instead
+	// of dropping it
+	bool coalesce;
+
+	// table of event data fields which must be equal to given value, or
+	// start with given string if value is { "prefix": "..." }
+	struct blob_attr *filter;
+	// array of names of event data fields to send, others are left out
+	struct blob_attr *fields;
+};
+
 struct ubusrpc_blob_sub {
 	union {
 		struct ubusrpc_blob;
@@ -33,13 +54,14 @@ struct ubusrpc_blob_sub {
 	};
 
 	const char *pattern;
+	struct ubusrpc_sub_opts opts;
 };
 
 struct ubusrpc_blob;
 struct lws;
 
-struct ubusrpc_blob* ubusrpc_blob_sub_parse(struct blob_attr *blob);
-struct ubusrpc_blob* ubusrpc_blob_sub_list_parse(struct blob_attr *blob);
+struct ubusrpc_blob* ubusrpc_blob_sub_parse(struct blob_attr *blob, size_t tailroom);
+struct ubusrpc_blob* ubusrpc_blob_sub_list_parse(struct blob_attr *blob, size_t tailroom);
 
 int ubusrpc_handle_sub(struct lws *wsi, struct ubusrpc_blob *ubusrpc, struct blob_attr *id);
 int ubusrpc_handle_sub_list(struct lws *wsi, struct ubusrpc_blob *ubusrpc, struct blob_attr *id);
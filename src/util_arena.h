@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * per-request arena allocator
+ *
+ * Objects which live as long as one request are allocated from the arena by
+ * bumping a pointer, and are all released at once when the request is done.
+ * Arena has one inline chunk; if that is exhausted, further chunks are chained
+ * to it.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** \brief size of inline chunk which fits all allocations of a typical call */
+#define WSU_ARENA_DEFAULT_SIZE 1024
+
+struct wsu_arena {
+	/** \brief most recently added overflow chunk, chunks are chained by this */
+	struct wsu_arena *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+};
+
+static inline struct wsu_arena *wsu_arena_new(size_t size)
+{
+	struct wsu_arena *a = malloc(sizeof *a + size);
+	if (!a)
+		return NULL;
+
+	a->next = NULL;
+	a->size = size;
+	a->used = 0;
+	return a;
+}
+
+/**
+ * \brief free the arena and everything allocated from it
+ */
+static inline void wsu_arena_free(struct wsu_arena *a)
+{
+	while (a) {
+		struct wsu_arena *next = a->next;
+		free(a);
+		a = next;
+	}
+}
+
+static inline void *wsu_arena_chunk_alloc(struct wsu_arena *c, size_t len)
+{
+	if (c->size - c->used < len)
+		return NULL;
+
+	void *ret = (char *)c->data + c->used;
+	c->used += len;
+	return ret;
+}
+
+/**
+ * \brief allocate memory from arena, aligned for any type. Memory is not to
+ * be freed other than by wsu_arena_free
+ */
+static inline void *wsu_arena_alloc(struct wsu_arena *a, size_t len)
+{
+	len = (len + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+	void *ret = wsu_arena_chunk_alloc(a, len);
+	if (!ret && a->next)
+		ret = wsu_arena_chunk_alloc(a->next, len);
+
+	if (!ret) {
+		// new chunk is linked first after head, so head stays the handle
+		struct wsu_arena *c = wsu_arena_new(len > a->size ? len : a->size);
+		if (!c)
+			return NULL;
+		c->next = a->next;
+		a->next = c;
+		ret = wsu_arena_chunk_alloc(c, len);
+	}
+
+	return ret;
+}
+
+/**
+ * \brief allocate zeroed memory from arena
+ */
+static inline void *wsu_arena_zalloc(struct wsu_arena *a, size_t len)
+{
+	void *ret = wsu_arena_alloc(a, len);
+	if (ret)
+		memset(ret, 0, len);
+	return ret;
+}
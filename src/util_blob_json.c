@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * blobmsg to JSON text serializer
+ */
+#include "util_blob_json.h"
+
+#include <libubox/blobmsg.h>
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// first allocation, then doubled
+#define JSON_OUT_INITIAL 1024
+
+void json_out_init(struct json_out *o, size_t head, size_t tail)
+{
+	o->buf = NULL;
+	o->head = head;
+	o->tail = tail;
+	o->len = 0;
+	o->alloc = 0;
+	o->error = false;
+}
+
+void json_out_free(struct json_out *o)
+{
+	free(o->buf);
+	o->buf = NULL;
+	o->len = 0;
+	o->alloc = 0;
+}
+
+char *json_out_steal(struct json_out *o)
+{
+	char *ret = o->buf;
+	o->buf = NULL;
+	o->len = 0;
+	o->alloc = 0;
+	return ret;
+}
+
+static bool json_out_reserve(struct json_out *o, size_t len)
+{
+	if (o->error)
+		return false;
+
+	size_t need = o->head + o->len + len + o->tail;
+	if (need <= o->alloc)
+		return true;
+
+	size_t alloc = o->alloc ? o->alloc : JSON_OUT_INITIAL;
+	while (alloc < need)
+		alloc *= 2;
+
+	char *buf = realloc(o->buf, alloc);
+	if (!buf) {
+		o->error = true;
+		return false;
+	}
+
+	o->buf = buf;
+	o->alloc = alloc;
+	return true;
+}
+
+void json_out_raw(struct json_out *o, const char *s, size_t len)
+{
+	if (!json_out_reserve(o, len))
+		return;
+
+	memcpy(o->buf + o->head + o->len, s, len);
+	o->len += len;
+}
+
+void json_out_string(struct json_out *o, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)s, *last = p;
+
+	json_out_lit(o, "\"");
+	for (; *p; ++p) {
+		char esc;
+		switch (*p) {
+		case '\b': esc = 'b'; break;
+		case '\n': esc = 'n'; break;
+		case '\t': esc = 't'; break;
+		case '\r': esc = 'r'; break;
+		case '"': esc = '"'; break;
+		case '\\': esc = '\\'; break;
+		case '/': esc = '/'; break;
+		default:
+			if (*p >= ' ')
+				continue;
+			esc = 'u';
+		}
+
+		// flush the run of characters which need no escaping
+		json_out_raw(o, (const char *)last, (size_t)(p - last));
+		last = p + 1;
+
+		if (esc == 'u') {
+			char buf[6] = { '\\', 'u', '0', '0', hex[*p >> 4], hex[*p & 0xf] };
+			json_out_raw(o, buf, sizeof buf);
+		} else {
+			char buf[2] = { '\\', esc };
+			json_out_raw(o, buf, sizeof buf);
+		}
+	}
+	json_out_raw(o, (const char *)last, (size_t)(p - last));
+	json_out_lit(o, "\"");
+}
+
+void json_out_int(struct json_out *o, int v)
+{
+	char buf[16];
+	int n = snprintf(buf, sizeof buf, "%d", v);
+	json_out_raw(o, buf, (size_t)n);
+}
+
+void json_out_value(struct json_out *o, const struct blob_attr *attr)
+{
+	// "%lf" of -DBL_MAX is 317 characters, as in libubox blobmsg_format_json
+	char buf[320];
+	int n;
+
+	switch (blobmsg_type(attr)) {
+	case BLOBMSG_TYPE_TABLE:
+		json_out_container(o, attr, false);
+		return;
+	case BLOBMSG_TYPE_ARRAY:
+		json_out_container(o, attr, true);
+		return;
+	case BLOBMSG_TYPE_STRING:
+		json_out_string(o, blobmsg_get_string((struct blob_attr *)attr));
+		return;
+	case BLOBMSG_TYPE_BOOL:
+		if (blobmsg_get_bool((struct blob_attr *)attr))
+			json_out_lit(o, "true");
+		else
+			json_out_lit(o, "false");
+		return;
+	case BLOBMSG_TYPE_INT16:
+		n = snprintf(buf, sizeof buf, "%d", (int16_t)blobmsg_get_u16((struct blob_attr *)attr));
+		break;
+	case BLOBMSG_TYPE_INT32:
+		n = snprintf(buf, sizeof buf, "%d", (int32_t)blobmsg_get_u32((struct blob_attr *)attr));
+		break;
+	case BLOBMSG_TYPE_INT64:
+		n = snprintf(buf, sizeof buf, "%" PRId64, (int64_t)blobmsg_get_u64((struct blob_attr *)attr));
+		break;
+	case BLOBMSG_TYPE_DOUBLE:
+		n = snprintf(buf, sizeof buf, "%lf", blobmsg_get_double((struct blob_attr *)attr));
+		break;
+	default:
+		json_out_lit(o, "null");
+		return;
+	}
+
+	if (n < 0)
+		n = 0;
+	else if ((size_t)n >= sizeof buf)
+		n = sizeof buf - 1;
+	json_out_raw(o, buf, (size_t)n);
+}
+
+void json_out_container(struct json_out *o, const struct blob_attr *attr, bool array)
+{
+	struct blob_attr *pos;
+	unsigned int rem;
+	bool first = true;
+
+	json_out_raw(o, array ? "[" : "{", 1);
+	blobmsg_for_each_attr(pos, (struct blob_attr *)attr, rem) {
+		if (!first)
+			json_out_lit(o, ",");
+		first = false;
+
+		if (!array) {
+			json_out_string(o, blobmsg_name(pos));
+			json_out_lit(o, ":");
+		}
+		json_out_value(o, pos);
+	}
+	json_out_raw(o, array ? "]" : "}", 1);
+}
+
+void json_out_cursor_init(struct json_out_cursor *c, const struct blob_attr *attr, bool array)
+{
+	c->root = attr;
+	c->root_array = array;
+	c->started = false;
+	c->depth = 0;
+}
+
+static void json_out_cursor_push(struct json_out_cursor *c, struct json_out *o, const struct blob_attr *attr, bool array)
+{
+	json_out_raw(o, array ? "[" : "{", 1);
+
+	c->stack[c->depth].pos = blobmsg_data(attr);
+	c->stack[c->depth].rem = (unsigned int)blobmsg_data_len(attr);
+	c->stack[c->depth].array = array;
+	c->stack[c->depth].first = true;
+	++c->depth;
+}
+
+bool json_out_cursor_next(struct json_out_cursor *c, struct json_out *o, size_t len)
+{
+	if (!c->started) {
+		c->started = true;
+		json_out_cursor_push(c, o, c->root, c->root_array);
+	}
+
+	while (c->depth && o->len < len && !o->error) {
+		// same bounds as blobmsg_for_each_attr
+		const struct blob_attr *cur = c->stack[c->depth - 1].pos;
+		unsigned int rem = c->stack[c->depth - 1].rem;
+		if (rem < sizeof(struct blob_attr) || blob_pad_len(cur) > rem || blob_pad_len(cur) < sizeof(struct blob_attr)) {
+			json_out_raw(o, c->stack[c->depth - 1].array ? "]" : "}", 1);
+			--c->depth;
+			continue;
+		}
+
+		c->stack[c->depth - 1].pos = blob_next(cur);
+		c->stack[c->depth - 1].rem = rem - (unsigned int)blob_pad_len(cur);
+
+		if (!c->stack[c->depth - 1].first)
+			json_out_lit(o, ",");
+		c->stack[c->depth - 1].first = false;
+
+		if (!c->stack[c->depth - 1].array) {
+			json_out_string(o, blobmsg_name(cur));
+			json_out_lit(o, ":");
+		}
+
+		int type = blobmsg_type(cur);
+		if ((type == BLOBMSG_TYPE_TABLE || type == BLOBMSG_TYPE_ARRAY) && c->depth < JSON_OUT_CURSOR_DEPTH)
+			json_out_cursor_push(c, o, cur, type == BLOBMSG_TYPE_ARRAY);
+		else
+			json_out_value(o, cur);
+	}
+
+	return !c->depth;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * blobmsg to JSON text serializer
+ *
+ * Formats blobmsg the same way blobmsg_format_json does, but appends the text
+ * to a growable buffer owned by the caller. The buffer can reserve room before
+ * and after the text, so it can be handed over for writing (e.g. as websocket
+ * write request with LWS padding) without copying it. With a cursor, a
+ * container is written in pieces, each one when the caller asks for it, so big
+ * messages can be sent out in fragments without all their text in memory.
+ */
+#pragma once
+
+#include <libubox/blobmsg.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+struct json_out {
+	/** \brief malloc'd buffer, text starts at buf + head */
+	char *buf;
+	size_t head;
+	size_t tail;
+	/** \brief length of text so far */
+	size_t len;
+	size_t alloc;
+	/** \brief set if allocation failed, text is then incomplete */
+	bool error;
+};
+
+/** \brief containers nested deeper than this are written whole by cursor */
+#define JSON_OUT_CURSOR_DEPTH 16
+
+/**
+ * \brief position in blobmsg container which is written as JSON in pieces
+ */
+struct json_out_cursor {
+	const struct blob_attr *root;
+	bool root_array;
+	bool started;
+
+	/** \brief number of containers opened and not yet closed */
+	unsigned int depth;
+	struct {
+		/** \brief next member, and bytes of container left from it */
+		const struct blob_attr *pos;
+		unsigned int rem;
+		bool array;
+		bool first;
+	} stack[JSON_OUT_CURSOR_DEPTH];
+};
+
+/**
+ * \brief prepare empty output, nothing is allocated until first write
+ *
+ * \param o output to prepare
+ * \param head how many bytes to reserve before the text
+ * \param tail how many bytes to keep free after the text
+ */
+void json_out_init(struct json_out *o, size_t head, size_t tail);
+
+void json_out_free(struct json_out *o);
+
+/** \brief take over the buffer, output is empty afterwards */
+char *json_out_steal(struct json_out *o);
+
+/** \brief append text as is */
+void json_out_raw(struct json_out *o, const char *s, size_t len);
+
+/** \brief append string literal as is */
+#define json_out_lit(o, s) json_out_raw((o), (s), sizeof(s) - 1)
+
+/** \brief append string as quoted and escaped JSON string */
+void json_out_string(struct json_out *o, const char *s);
+
+void json_out_int(struct json_out *o, int v);
+
+/** \brief append value of blobmsg attribute, name is ignored */
+void json_out_value(struct json_out *o, const struct blob_attr *attr);
+
+/**
+ * \brief append members of attr (blobmsg table or root attr made by
+ * blob_buf_init) as JSON object, or elements as JSON array
+ */
+void json_out_container(struct json_out *o, const struct blob_attr *attr, bool array);
+
+/**
+ * \brief prepare to write attr like json_out_container, in pieces. attr has to
+ * stay valid until it is all written
+ */
+void json_out_cursor_init(struct json_out_cursor *c, const struct blob_attr *attr, bool array);
+
+/**
+ * \brief append next piece of container to the output, until output is at
+ * least len long or container is done. Scalar values are not split, so output
+ * may end up longer
+ *
+ * @return true when whole container was written
+ */
+bool json_out_cursor_next(struct json_out_cursor *c, struct json_out *o, size_t len);
+
+/** \brief text written so far */
+static inline char *json_out_text(const struct json_out *o)
+{
+	return o->buf ? o->buf + o->head : NULL;
+}
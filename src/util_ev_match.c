@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * index of event name patterns
+ */
+#include "util_ev_match.h"
+
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * \brief trie node, for one dot-separated segment of prefix patterns
+ */
+struct wsu_ev_match_node {
+	struct avl_node avl; // in children of parent
+	struct wsu_ev_match_node *parent;
+
+	struct avl_tree children;
+	// prefix patterns whose last dot is after this node's segment
+	struct list_head prefixes;
+
+	char seg[];
+};
+
+static struct wsu_ev_match_node *node_new(struct wsu_ev_match_node *parent, const char *seg)
+{
+	struct wsu_ev_match_node *n = calloc(1, sizeof *n + strlen(seg) + 1);
+	if (!n)
+		return NULL;
+
+	strcpy(n->seg, seg);
+	n->parent = parent;
+	avl_init(&n->children, avl_strcmp, false, NULL);
+	INIT_LIST_HEAD(&n->prefixes);
+
+	if (parent) {
+		n->avl.key = n->seg;
+		avl_insert(&parent->children, &n->avl);
+	}
+	return n;
+}
+
+/**
+ * \brief free nodes which have no patterns left under them, going up from n
+ */
+static void node_prune(struct wsu_ev_match *m, struct wsu_ev_match_node *n)
+{
+	while (n && n != m->root && list_empty(&n->prefixes) && avl_is_empty(&n->children)) {
+		struct wsu_ev_match_node *parent = n->parent;
+		avl_delete(&parent->children, &n->avl);
+		free(n);
+		n = parent;
+	}
+}
+
+void wsu_ev_match_init(struct wsu_ev_match *m)
+{
+	avl_init(&m->exact, avl_strcmp, false, NULL);
+	m->root = NULL;
+	INIT_LIST_HEAD(&m->globs);
+}
+
+int wsu_ev_match_add(struct wsu_ev_match *m, struct wsu_ev_match_entry *e, const char *pattern)
+{
+	size_t len = strlen(pattern);
+	size_t plain_len = strcspn(pattern, "*?[\\");
+
+	e->pattern = pattern;
+	e->node = NULL;
+
+	if (plain_len == len) {
+		e->kind = WSU_EV_MATCH_EXACT;
+		e->avl.key = pattern;
+		return avl_insert(&m->exact, &e->avl) ? -1 : 0;
+	}
+
+	if (plain_len != len - 1) {
+		// '*' is not just at the end, or there are other special chars
+		e->kind = WSU_EV_MATCH_GLOB;
+		list_add_tail(&e->list, &m->globs);
+		return 0;
+	}
+
+	e->kind = WSU_EV_MATCH_PREFIX;
+
+	if (!m->root && !(m->root = node_new(NULL, "")))
+		return -1;
+
+	// split the prefix (pattern without '*') into segments
+	char *buf = strndup(pattern, plain_len);
+	if (!buf)
+		return -1;
+
+	struct wsu_ev_match_node *n = m->root;
+	char *seg = buf, *dot;
+	while ((dot = strchr(seg, '.'))) {
+		*dot = '\0';
+		struct wsu_ev_match_node *child = avl_find_element(&n->children, seg, child, avl);
+		if (!child && !(child = node_new(n, seg))) {
+			node_prune(m, n);
+			free(buf);
+			return -1;
+		}
+		n = child;
+		seg = dot + 1;
+	}
+
+	e->node = n;
+	e->partial = pattern + (seg - buf);
+	e->partial_len = plain_len - (seg - buf);
+	list_add_tail(&e->list, &n->prefixes);
+
+	free(buf);
+	return 0;
+}
+
+void wsu_ev_match_del(struct wsu_ev_match *m, struct wsu_ev_match_entry *e)
+{
+	switch (e->kind) {
+	case WSU_EV_MATCH_EXACT:
+		avl_delete(&m->exact, &e->avl);
+		break;
+	case WSU_EV_MATCH_PREFIX:
+		list_del(&e->list);
+		node_prune(m, e->node);
+		break;
+	case WSU_EV_MATCH_GLOB:
+		list_del(&e->list);
+		break;
+	}
+}
+
+void wsu_ev_match_foreach(struct wsu_ev_match *m, const char *name, wsu_ev_match_cb cb, void *ctx)
+{
+	struct wsu_ev_match_entry *e;
+
+	if ((e = avl_find_element(&m->exact, name, e, avl)))
+		cb(e, ctx);
+
+	list_for_each_entry(e, &m->globs, list) {
+		if (!fnmatch(e->pattern, name, 0))
+			cb(e, ctx);
+	}
+
+	if (!m->root)
+		return;
+
+	// segments are cut out of a copy, to look up children by them
+	char *buf = strdup(name);
+	if (!buf)
+		return;
+
+	struct wsu_ev_match_node *n = m->root;
+	char *seg = buf, *dot;
+	for (;;) {
+		// the rest of name after this node, still uncut in original
+		const char *rest = name + (seg - buf);
+		list_for_each_entry(e, &n->prefixes, list) {
+			if (!strncmp(rest, e->partial, e->partial_len))
+				cb(e, ctx);
+		}
+
+		if (!(dot = strchr(seg, '.')))
+			break;
+		*dot = '\0';
+		if (!(n = avl_find_element(&n->children, seg, n, avl)))
+			break;
+		seg = dot + 1;
+	}
+
+	free(buf);
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * index of event name patterns, for finding those which match an event
+ *
+ * Patterns are fnmatch(3) globs, as subscribers give them. Most are either
+ * plain names or a name prefix followed by '*' (e.g. "network.interface.*"),
+ * so these are indexed: plain names in a tree by name, prefixes in a trie of
+ * dot-separated segments. Matches are then found in time proportional to the
+ * length of event name, not to number of patterns. Other globs are few, and
+ * are matched one by one.
+ */
+#pragma once
+
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
+#include <libubox/list.h>
+
+#include <stddef.h>
+
+struct wsu_ev_match_node;
+
+/**
+ * \brief pattern in the index, embedded in the caller's structure. Same
+ * pattern should be added only once
+ */
+struct wsu_ev_match_entry {
+	const char *pattern;
+
+	enum wsu_ev_match_kind {
+		WSU_EV_MATCH_EXACT,
+		WSU_EV_MATCH_PREFIX,
+		WSU_EV_MATCH_GLOB,
+	} kind;
+
+	union {
+		struct avl_node avl; // exact, by name
+		struct list_head list; // prefix, in its trie node; glob
+	};
+
+	// prefix: trie node of all segments before last dot, and the rest of
+	// prefix after it
+	struct wsu_ev_match_node *node;
+	const char *partial;
+	size_t partial_len;
+};
+
+/**
+ * \brief the index
+ */
+struct wsu_ev_match {
+	struct avl_tree exact;
+	struct wsu_ev_match_node *root;
+	struct list_head globs;
+};
+
+#define WSU_EV_MATCH_INIT(_name) { \
+	.exact = AVL_TREE_INIT(_name.exact, avl_strcmp, false, NULL), \
+	.root = NULL, \
+	.globs = LIST_HEAD_INIT(_name.globs), \
+}
+
+/** \brief define index, ready to use, like AVL_TREE does */
+#define WSU_EV_MATCH(_name) struct wsu_ev_match _name = WSU_EV_MATCH_INIT(_name)
+
+void wsu_ev_match_init(struct wsu_ev_match *m);
+
+/**
+ * \brief add pattern to index
+ *
+ * \param e entry to add, pattern string must outlive it
+ *
+ * @return 0 if succeeded
+ */
+int wsu_ev_match_add(struct wsu_ev_match *m, struct wsu_ev_match_entry *e, const char *pattern);
+
+/** \brief remove pattern from index */
+void wsu_ev_match_del(struct wsu_ev_match *m, struct wsu_ev_match_entry *e);
+
+typedef void (*wsu_ev_match_cb)(struct wsu_ev_match_entry *e, void *ctx);
+
+/**
+ * \brief call cb for each pattern which matches event name. Index must not be
+ * changed from cb
+ */
+void wsu_ev_match_foreach(struct wsu_ev_match *m, const char *name, wsu_ev_match_cb cb, void *ctx);
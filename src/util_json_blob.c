@@ -0,0 +1,712 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * streaming JSON text to blobmsg parser
+ */
+#include "util_json_blob.h"
+
+#include <libubox/blobmsg.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// parsed data buffer bigger than this is released on reset, so that one big
+// message doesn't pin memory for the rest of connection's life
+#define JSON_BLOB_KEEP_BUFLEN 4096
+
+// initial size of string buffer reserved in blob for string values
+#define JSON_BLOB_STR_INITIAL 64
+
+enum jb_state {
+	JB_VALUE,           // expecting any value
+	JB_OBJ_FIRST_KEY,   // after '{', expecting key or '}'
+	JB_OBJ_KEY,         // after ',' in object, expecting key
+	JB_OBJ_COLON,       // after key, expecting ':'
+	JB_OBJ_NEXT,        // after member, expecting ',' or '}'
+	JB_ARR_FIRST,       // after '[', expecting value or ']'
+	JB_ARR_NEXT,        // after element, expecting ',' or ']'
+	JB_STRING,
+	JB_STRING_ESC,      // after backslash in string
+	JB_STRING_UNICODE,  // in \uXXXX escape
+	JB_NUMBER,
+	JB_LITERAL,         // true, false, null
+	JB_DONE,
+	JB_ERROR,
+};
+
+struct jb_frame {
+	void *cookie; // from blobmsg_open_*, NULL for top-level container
+	bool is_array;
+};
+
+struct json_blob_parser {
+	struct blob_buf b;
+
+	enum jb_state state;
+	int type;
+
+	int depth;
+	struct jb_frame stack[JSON_BLOB_MAX_DEPTH];
+
+	// key of object member whose value comes next
+	char *key;
+	size_t key_len;
+	size_t key_size;
+
+	// string being parsed goes into key buffer, or directly into the blob
+	bool str_is_key;
+	char *str;
+	size_t str_len;
+	size_t str_size;
+
+	// \uXXXX escape decoding
+	uint32_t ucs;
+	int ucs_digits;
+	uint32_t hi_surrogate;
+
+	// number or literal token
+	char tok[64];
+	size_t tok_len;
+
+	size_t offset;
+	const char *error;
+};
+
+struct json_blob_parser *json_blob_parser_new(void)
+{
+	struct json_blob_parser *p = calloc(1, sizeof *p);
+	if (!p)
+		return NULL;
+
+	json_blob_parser_reset(p);
+	return p;
+}
+
+void json_blob_parser_free(struct json_blob_parser *p)
+{
+	if (!p)
+		return;
+
+	blob_buf_free(&p->b);
+	free(p->key);
+	free(p);
+}
+
+void json_blob_parser_reset(struct json_blob_parser *p)
+{
+	if (p->b.buflen > JSON_BLOB_KEEP_BUFLEN)
+		blob_buf_free(&p->b);
+	blob_buf_init(&p->b, 0);
+
+	p->state = JB_VALUE;
+	p->type = __BLOBMSG_TYPE_LAST;
+	p->depth = 0;
+	p->key_len = 0;
+	p->str = NULL;
+	p->hi_surrogate = 0;
+	p->tok_len = 0;
+	p->offset = 0;
+	p->error = NULL;
+}
+
+// parsers are needed only while message is being received, so instead of
+// one per connection, few idle ones are kept here for reuse
+static struct json_blob_parser *pool[JSON_BLOB_POOL_SIZE];
+static unsigned int pool_len;
+
+struct json_blob_parser *json_blob_parser_pool_get(void)
+{
+	if (pool_len)
+		return pool[--pool_len];
+
+	return json_blob_parser_new();
+}
+
+void json_blob_parser_pool_put(struct json_blob_parser *p)
+{
+	if (!p)
+		return;
+
+	if (pool_len < JSON_BLOB_POOL_SIZE) {
+		json_blob_parser_reset(p);
+		pool[pool_len++] = p;
+	} else {
+		json_blob_parser_free(p);
+	}
+}
+
+int json_blob_parser_type(const struct json_blob_parser *p)
+{
+	return p->type;
+}
+
+struct blob_attr *json_blob_parser_result(const struct json_blob_parser *p)
+{
+	return p->b.head;
+}
+
+struct blob_attr *json_blob_parser_steal(struct json_blob_parser *p, size_t *size)
+{
+	// blob_buf_init placed root at the start of the buffer
+	struct blob_attr *ret = p->b.buf;
+
+	if (size)
+		*size = (size_t)p->b.buflen;
+
+	// next reset will allocate a new one
+	p->b.buf = NULL;
+	p->b.head = NULL;
+	p->b.buflen = 0;
+
+	return ret;
+}
+
+size_t json_blob_parser_offset(const struct json_blob_parser *p)
+{
+	return p->offset;
+}
+
+const char *json_blob_parser_error_desc(const struct json_blob_parser *p)
+{
+	return p->error ? p->error : "success";
+}
+
+static enum json_blob_status jb_fail(struct json_blob_parser *p, const char *error)
+{
+	p->state = JB_ERROR;
+	p->error = error;
+	return JSON_BLOB_ERROR;
+}
+
+static inline bool jb_is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/**
+ * \brief name under which the value that comes next is added
+ */
+static inline const char *jb_value_name(struct json_blob_parser *p)
+{
+	if (p->depth && !p->stack[p->depth-1].is_array)
+		return p->key;
+	return "";
+}
+
+/**
+ * \brief go to state expected after a complete value
+ */
+static void jb_value_done(struct json_blob_parser *p)
+{
+	if (!p->depth)
+		p->state = JB_DONE;
+	else
+		p->state = p->stack[p->depth-1].is_array ? JB_ARR_NEXT : JB_OBJ_NEXT;
+}
+
+static bool jb_open(struct json_blob_parser *p, bool is_array)
+{
+	if (p->depth == JSON_BLOB_MAX_DEPTH)
+		return false;
+
+	void *cookie = NULL;
+	if (p->depth) {
+		cookie = blobmsg_open_nested(&p->b, jb_value_name(p), is_array);
+		if (!cookie)
+			return false;
+	} else {
+		// top-level container's contents go directly into root, like blobmsg_add_object
+		p->type = is_array ? BLOBMSG_TYPE_ARRAY : BLOBMSG_TYPE_TABLE;
+	}
+
+	p->stack[p->depth].cookie = cookie;
+	p->stack[p->depth].is_array = is_array;
+	++p->depth;
+
+	p->state = is_array ? JB_ARR_FIRST : JB_OBJ_FIRST_KEY;
+	return true;
+}
+
+static void jb_close(struct json_blob_parser *p)
+{
+	--p->depth;
+	if (p->stack[p->depth].cookie)
+		blob_nest_end(&p->b, p->stack[p->depth].cookie);
+	jb_value_done(p);
+}
+
+static void jb_scalar_added(struct json_blob_parser *p, int type)
+{
+	if (!p->depth)
+		p->type = type;
+	jb_value_done(p);
+}
+
+//{{{ strings
+static bool jb_str_reserve(struct json_blob_parser *p, size_t n)
+{
+	// always keep one byte for terminating nul
+	if (p->str_is_key) {
+		if (p->key_len + n + 1 <= p->key_size)
+			return true;
+		size_t sz = p->key_size ? p->key_size : 32;
+		while (sz < p->key_len + n + 1)
+			sz *= 2;
+		char *k = realloc(p->key, sz);
+		if (!k)
+			return false;
+		p->key = k;
+		p->key_size = sz;
+	} else {
+		if (p->str_len + n + 1 <= p->str_size)
+			return true;
+		size_t sz = p->str_size;
+		while (sz < p->str_len + n + 1)
+			sz *= 2;
+		char *s = blobmsg_realloc_string_buffer(&p->b, (unsigned)sz);
+		if (!s)
+			return false;
+		p->str = s;
+		p->str_size = sz;
+	}
+	return true;
+}
+
+static bool jb_str_start(struct json_blob_parser *p, bool is_key)
+{
+	p->str_is_key = is_key;
+	p->str_len = 0;
+	p->hi_surrogate = 0;
+
+	if (is_key) {
+		p->key_len = 0;
+		return jb_str_reserve(p, 0);
+	}
+
+	// value strings are written straight into the blob
+	p->str = blobmsg_alloc_string_buffer(&p->b, jb_value_name(p), JSON_BLOB_STR_INITIAL);
+	p->str_size = JSON_BLOB_STR_INITIAL;
+	return !!p->str;
+}
+
+static bool jb_str_append(struct json_blob_parser *p, const char *s, size_t n)
+{
+	if (!jb_str_reserve(p, n))
+		return false;
+
+	if (p->str_is_key) {
+		memcpy(p->key + p->key_len, s, n);
+		p->key_len += n;
+	} else {
+		memcpy(p->str + p->str_len, s, n);
+		p->str_len += n;
+	}
+	return true;
+}
+
+static bool jb_str_append_ucs(struct json_blob_parser *p, uint32_t cp)
+{
+	char u[4];
+	size_t n;
+
+	if (cp < 0x80) {
+		u[0] = (char)cp;
+		n = 1;
+	} else if (cp < 0x800) {
+		u[0] = (char)(0xc0 | (cp >> 6));
+		u[1] = (char)(0x80 | (cp & 0x3f));
+		n = 2;
+	} else if (cp < 0x10000) {
+		u[0] = (char)(0xe0 | (cp >> 12));
+		u[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		u[2] = (char)(0x80 | (cp & 0x3f));
+		n = 3;
+	} else {
+		u[0] = (char)(0xf0 | (cp >> 18));
+		u[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+		u[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+		u[3] = (char)(0x80 | (cp & 0x3f));
+		n = 4;
+	}
+
+	return jb_str_append(p, u, n);
+}
+
+/**
+ * \brief a lone high surrogate is not valid UTF-16, emit replacement character for it
+ */
+static bool jb_str_flush_surrogate(struct json_blob_parser *p)
+{
+	if (!p->hi_surrogate)
+		return true;
+	p->hi_surrogate = 0;
+	return jb_str_append_ucs(p, 0xfffd);
+}
+
+static bool jb_str_add_ucs(struct json_blob_parser *p, uint32_t cp)
+{
+	if (cp >= 0xdc00 && cp <= 0xdfff && p->hi_surrogate) {
+		cp = 0x10000 + ((p->hi_surrogate - 0xd800) << 10) + (cp - 0xdc00);
+		p->hi_surrogate = 0;
+		return jb_str_append_ucs(p, cp);
+	}
+
+	if (!jb_str_flush_surrogate(p))
+		return false;
+
+	if (cp >= 0xd800 && cp <= 0xdbff) {
+		p->hi_surrogate = cp;
+		return true;
+	}
+
+	return jb_str_append_ucs(p, cp >= 0xdc00 && cp <= 0xdfff ? 0xfffd : cp);
+}
+
+static bool jb_str_end(struct json_blob_parser *p)
+{
+	if (!jb_str_flush_surrogate(p))
+		return false;
+
+	if (p->str_is_key) {
+		p->key[p->key_len] = '\0';
+		p->state = JB_OBJ_COLON;
+		return true;
+	}
+
+	// same as blobmsg_add_object, string is cut at first nul if any
+	p->str[p->str_len] = '\0';
+	blobmsg_add_string_buffer(&p->b);
+	p->str = NULL;
+	jb_scalar_added(p, BLOBMSG_TYPE_STRING);
+	return true;
+}
+
+static inline int jb_hexval(char c)
+{
+	return
+		c >= '0' && c <= '9' ? c - '0' :
+		c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+		c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+//}}}
+
+//{{{ numbers and literals
+static bool jb_number_valid(const char *s)
+{
+	// -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	if (*s == '-')
+		++s;
+	if (*s == '0')
+		++s;
+	else if (*s >= '1' && *s <= '9')
+		while (*s >= '0' && *s <= '9') ++s;
+	else
+		return false;
+
+	if (*s == '.') {
+		++s;
+		if (!(*s >= '0' && *s <= '9'))
+			return false;
+		while (*s >= '0' && *s <= '9') ++s;
+	}
+
+	if (*s == 'e' || *s == 'E') {
+		++s;
+		if (*s == '+' || *s == '-')
+			++s;
+		if (!(*s >= '0' && *s <= '9'))
+			return false;
+		while (*s >= '0' && *s <= '9') ++s;
+	}
+
+	return *s == '\0';
+}
+
+static enum json_blob_status jb_number_end(struct json_blob_parser *p)
+{
+	p->tok[p->tok_len] = '\0';
+
+	if (!jb_number_valid(p->tok))
+		return jb_fail(p, "invalid number");
+
+	const char *name = jb_value_name(p);
+	int type;
+
+	if (strpbrk(p->tok, ".eE")) {
+		blobmsg_add_double(&p->b, name, strtod(p->tok, NULL));
+		type = BLOBMSG_TYPE_DOUBLE;
+	} else {
+		// out of range saturates, as json-c does it
+		errno = 0;
+		long long v = strtoll(p->tok, NULL, 10);
+		if (v >= INT32_MIN && v <= INT32_MAX) {
+			blobmsg_add_u32(&p->b, name, (uint32_t)v);
+			type = BLOBMSG_TYPE_INT32;
+		} else {
+			blobmsg_add_u64(&p->b, name, (uint64_t)v);
+			type = BLOBMSG_TYPE_INT64;
+		}
+	}
+
+	jb_scalar_added(p, type);
+	return JSON_BLOB_CONTINUE;
+}
+
+static enum json_blob_status jb_literal_end(struct json_blob_parser *p)
+{
+	p->tok[p->tok_len] = '\0';
+	const char *name = jb_value_name(p);
+
+	if (!strcmp(p->tok, "true")) {
+		blobmsg_add_u8(&p->b, name, 1);
+		jb_scalar_added(p, BLOBMSG_TYPE_BOOL);
+	} else if (!strcmp(p->tok, "false")) {
+		blobmsg_add_u8(&p->b, name, 0);
+		jb_scalar_added(p, BLOBMSG_TYPE_BOOL);
+	} else if (!strcmp(p->tok, "null")) {
+		// this works out to null in json
+		blobmsg_add_field(&p->b, BLOBMSG_TYPE_UNSPEC, name, NULL, 0);
+		jb_scalar_added(p, BLOBMSG_TYPE_UNSPEC);
+	} else {
+		return jb_fail(p, "invalid literal");
+	}
+
+	return JSON_BLOB_CONTINUE;
+}
+
+static inline bool jb_is_number_char(char c)
+{
+	return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+}
+//}}}
+
+/**
+ * \brief begin parsing a value starting with character c
+ */
+static enum json_blob_status jb_value_start(struct json_blob_parser *p, char c)
+{
+	switch (c) {
+	case '{':
+		if (!jb_open(p, false))
+			return jb_fail(p, "nesting too deep");
+		break;
+	case '[':
+		if (!jb_open(p, true))
+			return jb_fail(p, "nesting too deep");
+		break;
+	case '"':
+		if (!jb_str_start(p, false))
+			return jb_fail(p, "out of memory");
+		p->state = JB_STRING;
+		break;
+	case 't':
+	case 'f':
+	case 'n':
+		p->tok[0] = c;
+		p->tok_len = 1;
+		p->state = JB_LITERAL;
+		break;
+	default:
+		if (c == '-' || (c >= '0' && c <= '9')) {
+			p->tok[0] = c;
+			p->tok_len = 1;
+			p->state = JB_NUMBER;
+			break;
+		}
+		return jb_fail(p, "unexpected character");
+	}
+
+	return JSON_BLOB_CONTINUE;
+}
+
+enum json_blob_status json_blob_parser_feed(struct json_blob_parser *p, const char *in, size_t len)
+{
+	size_t i = 0;
+
+	while (i < len) {
+		char c = in[i];
+
+		switch (p->state) {
+		case JB_ERROR:
+			return JSON_BLOB_ERROR;
+
+		case JB_DONE:
+			if (!jb_is_space(c))
+				return jb_fail(p, "trailing data after value");
+			break;
+
+		case JB_VALUE:
+			if (jb_is_space(c))
+				break;
+			if (jb_value_start(p, c) == JSON_BLOB_ERROR)
+				return JSON_BLOB_ERROR;
+			break;
+
+		case JB_OBJ_FIRST_KEY:
+		case JB_OBJ_KEY:
+			if (jb_is_space(c))
+				break;
+			if (c == '}' && p->state == JB_OBJ_FIRST_KEY) {
+				jb_close(p);
+				break;
+			}
+			if (c != '"')
+				return jb_fail(p, "expected object key");
+			if (!jb_str_start(p, true))
+				return jb_fail(p, "out of memory");
+			p->state = JB_STRING;
+			break;
+
+		case JB_OBJ_COLON:
+			if (jb_is_space(c))
+				break;
+			if (c != ':')
+				return jb_fail(p, "expected ':' after object key");
+			p->state = JB_VALUE;
+			break;
+
+		case JB_OBJ_NEXT:
+			if (jb_is_space(c))
+				break;
+			if (c == ',')
+				p->state = JB_OBJ_KEY;
+			else if (c == '}')
+				jb_close(p);
+			else
+				return jb_fail(p, "expected ',' or '}' in object");
+			break;
+
+		case JB_ARR_FIRST:
+			if (jb_is_space(c))
+				break;
+			if (c == ']') {
+				jb_close(p);
+				break;
+			}
+			if (jb_value_start(p, c) == JSON_BLOB_ERROR)
+				return JSON_BLOB_ERROR;
+			break;
+
+		case JB_ARR_NEXT:
+			if (jb_is_space(c))
+				break;
+			if (c == ',')
+				p->state = JB_VALUE;
+			else if (c == ']')
+				jb_close(p);
+			else
+				return jb_fail(p, "expected ',' or ']' in array");
+			break;
+
+		case JB_STRING: {
+			// copy the run of plain characters at once
+			size_t run = i;
+			while (run < len && in[run] != '"' && in[run] != '\\')
+				++run;
+			if (run > i) {
+				if (!jb_str_flush_surrogate(p) || !jb_str_append(p, in + i, run - i))
+					return jb_fail(p, "out of memory");
+				p->offset += run - i;
+				i = run;
+				continue;
+			}
+			if (c == '"') {
+				if (!jb_str_end(p))
+					return jb_fail(p, "out of memory");
+			} else {
+				p->state = JB_STRING_ESC;
+			}
+			break;
+		}
+
+		case JB_STRING_ESC: {
+			char e;
+			switch (c) {
+			case '"':  e = '"';  break;
+			case '\\': e = '\\'; break;
+			case '/':  e = '/';  break;
+			case 'b':  e = '\b'; break;
+			case 'f':  e = '\f'; break;
+			case 'n':  e = '\n'; break;
+			case 'r':  e = '\r'; break;
+			case 't':  e = '\t'; break;
+			case 'u':
+				p->ucs = 0;
+				p->ucs_digits = 0;
+				p->state = JB_STRING_UNICODE;
+				goto next;
+			default:
+				return jb_fail(p, "invalid escape in string");
+			}
+			if (!jb_str_flush_surrogate(p) || !jb_str_append(p, &e, 1))
+				return jb_fail(p, "out of memory");
+			p->state = JB_STRING;
+			break;
+		}
+
+		case JB_STRING_UNICODE: {
+			int v = jb_hexval(c);
+			if (v < 0)
+				return jb_fail(p, "invalid \\u escape in string");
+			p->ucs = (p->ucs << 4) | (uint32_t)v;
+			if (++p->ucs_digits == 4) {
+				if (!jb_str_add_ucs(p, p->ucs))
+					return jb_fail(p, "out of memory");
+				p->state = JB_STRING;
+			}
+			break;
+		}
+
+		case JB_NUMBER:
+			if (jb_is_number_char(c)) {
+				if (p->tok_len + 1 >= sizeof p->tok)
+					return jb_fail(p, "number too long");
+				p->tok[p->tok_len++] = c;
+				break;
+			}
+			// number ended, character is reprocessed in the new state
+			if (jb_number_end(p) == JSON_BLOB_ERROR)
+				return JSON_BLOB_ERROR;
+			continue;
+
+		case JB_LITERAL:
+			if (c >= 'a' && c <= 'z') {
+				if (p->tok_len + 1 >= sizeof p->tok)
+					return jb_fail(p, "invalid literal");
+				p->tok[p->tok_len++] = c;
+				break;
+			}
+			if (jb_literal_end(p) == JSON_BLOB_ERROR)
+				return JSON_BLOB_ERROR;
+			continue;
+		}
+next:
+		++p->offset;
+		++i;
+	}
+
+	return
+		p->state == JB_DONE  ? JSON_BLOB_DONE  :
+		p->state == JB_ERROR ? JSON_BLOB_ERROR : JSON_BLOB_CONTINUE;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * streaming JSON text to blobmsg parser
+ *
+ * Parses JSON text fed in arbitrary pieces (e.g. websocket fragments) and
+ * emits blobmsg attributes as it goes, without building an intermediate
+ * json_object tree. The resulting blob has same layout as one made with
+ * blob_buf_init(.., 0) + blobmsg_add_object, i.e. members of top-level object
+ * (or elements of top-level array) are placed directly in the root attribute.
+ */
+#pragma once
+
+#include <libubox/blobmsg.h>
+#include <stddef.h>
+
+/** \brief same nesting limit json-c tokener uses by default */
+#define JSON_BLOB_MAX_DEPTH 32
+
+/** \brief how many idle parsers are kept for reuse */
+#define JSON_BLOB_POOL_SIZE 8
+
+enum json_blob_status {
+	JSON_BLOB_CONTINUE, // more input is needed
+	JSON_BLOB_DONE,     // complete value was parsed, only whitespace may follow
+	JSON_BLOB_ERROR,    // input is not valid JSON, rest of message is ignored
+};
+
+/**
+ * \brief parser state, opaque to callers
+ */
+struct json_blob_parser;
+
+struct json_blob_parser *json_blob_parser_new(void);
+
+void json_blob_parser_free(struct json_blob_parser *p);
+
+/**
+ * \brief prepare parser for next message, discarding any parsed data
+ */
+void json_blob_parser_reset(struct json_blob_parser *p);
+
+/**
+ * \brief feed next piece of JSON text into parser
+ *
+ * \param p parser
+ * \param in text to parse, need not be terminated
+ * \param len length of text
+ *
+ * @return parser status after consuming the text
+ */
+enum json_blob_status json_blob_parser_feed(struct json_blob_parser *p, const char *in, size_t len);
+
+/**
+ * \brief blobmsg type of the top-level JSON value, __BLOBMSG_TYPE_LAST if
+ * not known yet
+ */
+int json_blob_parser_type(const struct json_blob_parser *p);
+
+/**
+ * \brief root blob attribute holding the parsed data, valid until next reset
+ */
+struct blob_attr *json_blob_parser_result(const struct json_blob_parser *p);
+
+/**
+ * \brief take over the buffer holding parsed data, so it can outlive the
+ * parser. Root attribute is at the start of returned buffer, which is to be
+ * freed with free(). Parser has to be reset before it is fed again.
+ *
+ * \param p parser which returned JSON_BLOB_DONE
+ * \param size if non-NULL, set to allocated size of buffer, which may be
+ * more than the length of root attribute
+ */
+struct blob_attr *json_blob_parser_steal(struct json_blob_parser *p, size_t *size);
+
+/**
+ * \brief get a ready to use parser from pool of idle parsers, or a new one if
+ * pool is empty. Pool is not thread-safe, it is meant for event loop thread
+ */
+struct json_blob_parser *json_blob_parser_pool_get(void);
+
+/**
+ * \brief return parser to pool after it is no longer needed. Parser is reset,
+ * and freed if pool is full
+ */
+void json_blob_parser_pool_put(struct json_blob_parser *p);
+
+/** \brief how many characters were consumed since last reset */
+size_t json_blob_parser_offset(const struct json_blob_parser *p);
+
+/** \brief describe the error, if feed returned JSON_BLOB_ERROR */
+const char *json_blob_parser_error_desc(const struct json_blob_parser *p);
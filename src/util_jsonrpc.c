@@ -20,60 +20,130 @@
 #include "util_jsonrpc.h"
 #include <libubox/blobmsg_json.h>
 
-char* jsonrpc__resp_error(struct blob_attr *id, int error_code, struct blob_attr *error_data)
+// standard error codes with their messages, anything else is "Other error"
+#define JSONRPC_ERRORS(X) \
+	X(PARSE_ERROR,      -32700, "Parse error") \
+	X(INTERNAL_ERROR,   -32603, "Internal error") \
+	X(INVALID_REQUEST,  -32600, "Invalid Request") \
+	X(INVALID_PARAMS,   -32602, "Invalid params") \
+	X(METHOD_NOT_FOUND, -32601, "Method not found") \
+	X(OTHER,            -32050, "Other error")
+
+#define X(name, code, msg) \
+	_Static_assert(JSONRPC_ERRORCODE__##name == code, "code of " #name);
+JSONRPC_ERRORS(X)
+#undef X
+
+static const char *jsonrpc__error_message(int error_code)
 {
-	struct blob_buf resp_buf = {};
-	blob_buf_init(&resp_buf, 0);
+	switch (error_code) {
+#define X(name, code, msg) case code: return msg;
+	JSONRPC_ERRORS(X)
+#undef X
+	default: return "Other error";
+	}
+}
+
+const char *jsonrpc__resp_error_suffix(int error_code, size_t *len)
+{
+	static const struct {
+		int code;
+		const char *str;
+		size_t len;
+	} suffixes[] = {
+#define X(name, code, msg) { code, \
+	",\"error\":{\"code\":" #code ",\"message\":\"" msg "\"}}", \
+	sizeof(",\"error\":{\"code\":" #code ",\"message\":\"" msg "\"}}") - 1 },
+		JSONRPC_ERRORS(X)
+#undef X
+	};
+
+	for (size_t i = 0; i < sizeof suffixes / sizeof suffixes[0]; ++i)
+		if (suffixes[i].code == error_code) {
+			*len = suffixes[i].len;
+			return suffixes[i].str;
+		}
+
+	return NULL;
+}
+
+const char *jsonrpc__resp_status_suffix(int ubus_rc, size_t *len)
+{
+#define S(n) { ",\"result\":[" #n "]}", sizeof(",\"result\":[" #n "]}") - 1 }
+	static const struct {
+		const char *str;
+		size_t len;
+	} suffixes[] = {
+		S(0), S(1), S(2), S(3), S(4), S(5), S(6), S(7),
+		S(8), S(9), S(10), S(11), S(12), S(13), S(14), S(15),
+	};
+#undef S
+
+	if (ubus_rc < 0 || ubus_rc >= (int)(sizeof suffixes / sizeof suffixes[0]))
+		return NULL;
+
+	*len = suffixes[ubus_rc].len;
+	return suffixes[ubus_rc].str;
+}
+
+void jsonrpc__resp_error_blob(struct blob_buf *resp_buf, struct blob_attr *id, int error_code, struct blob_attr *error_data)
+{
+	blob_buf_init(resp_buf, 0);
 
-	blobmsg_add_string(&resp_buf, "jsonrpc", "2.0");
+	blobmsg_add_string(resp_buf, "jsonrpc", "2.0");
 	if (id) {
-		blobmsg_add_blob(&resp_buf, id);
+		blobmsg_add_blob(resp_buf, id);
 	} else {
 		// this works out to null in json
-		blobmsg_add_field(&resp_buf, BLOBMSG_TYPE_UNSPEC, "id", NULL, 0);
+		blobmsg_add_field(resp_buf, BLOBMSG_TYPE_UNSPEC, "id", NULL, 0);
 	}
 
-	void *obj_ticket = blobmsg_open_table(&resp_buf, "error");
+	void *obj_ticket = blobmsg_open_table(resp_buf, "error");
 
-	blobmsg_add_u32(&resp_buf, "code", (uint32_t)error_code);
-	blobmsg_add_string(&resp_buf, "message",
-			error_code == JSONRPC_ERRORCODE__PARSE_ERROR      ? "Parse error" :
-			error_code == JSONRPC_ERRORCODE__INTERNAL_ERROR   ? "Internal error" :
-			error_code == JSONRPC_ERRORCODE__INVALID_REQUEST  ? "Invalid Request" :
-			error_code == JSONRPC_ERRORCODE__INVALID_PARAMS   ? "Invalid params" :
-			error_code == JSONRPC_ERRORCODE__METHOD_NOT_FOUND ? "Method not found" :
-			"Other error");
+	blobmsg_add_u32(resp_buf, "code", (uint32_t)error_code);
+	blobmsg_add_string(resp_buf, "message", jsonrpc__error_message(error_code));
 	if (error_data && !strcmp("data", blobmsg_name(error_data)))
-		blobmsg_add_blob(&resp_buf, error_data);
+		blobmsg_add_blob(resp_buf, error_data);
+
+	blobmsg_close_table(resp_buf, obj_ticket);
+}
 
-	blobmsg_close_table(&resp_buf, obj_ticket);
+char* jsonrpc__resp_error(struct blob_attr *id, int error_code, struct blob_attr *error_data)
+{
+	struct blob_buf resp_buf = {};
+	jsonrpc__resp_error_blob(&resp_buf, id, error_code, error_data);
 
 	char *ret = blobmsg_format_json(resp_buf.head, true);
 	blob_buf_free(&resp_buf);
 	return ret;
 }
 
-char* jsonrpc__resp_ubus(struct blob_attr *id, int ubus_rc, struct blob_attr *ret_data)
+void jsonrpc__resp_ubus_blob(struct blob_buf *resp_buf, struct blob_attr *id, int ubus_rc, struct blob_attr *ret_data)
 {
-	struct blob_buf resp_buf = {};
-	blob_buf_init(&resp_buf, 0);
+	blob_buf_init(resp_buf, 0);
 
-	blobmsg_add_string(&resp_buf, "jsonrpc", "2.0");
+	blobmsg_add_string(resp_buf, "jsonrpc", "2.0");
 	if (id) {
-		blobmsg_add_blob(&resp_buf, id);
+		blobmsg_add_blob(resp_buf, id);
 	} else {
 		// this works out to null in json
-		blobmsg_add_field(&resp_buf, BLOBMSG_TYPE_UNSPEC, "id", NULL, 0);
+		blobmsg_add_field(resp_buf, BLOBMSG_TYPE_UNSPEC, "id", NULL, 0);
 	}
 
-	void *array_ticket = blobmsg_open_array(&resp_buf, "result");
-	blobmsg_add_u32(&resp_buf, "", (uint32_t)ubus_rc);
+	void *array_ticket = blobmsg_open_array(resp_buf, "result");
+	blobmsg_add_u32(resp_buf, "", (uint32_t)ubus_rc);
 
 	if (ret_data) {
-		blobmsg_add_field(&resp_buf, blobmsg_type(ret_data) == BLOBMSG_TYPE_ARRAY ? BLOBMSG_TYPE_ARRAY : BLOBMSG_TYPE_TABLE, "", blobmsg_data(ret_data), (unsigned)blobmsg_len(ret_data));
+		blobmsg_add_field(resp_buf, blobmsg_type(ret_data) == BLOBMSG_TYPE_ARRAY ? BLOBMSG_TYPE_ARRAY : BLOBMSG_TYPE_TABLE, "", blobmsg_data(ret_data), (unsigned)blobmsg_len(ret_data));
 	}
 
-	blobmsg_close_array(&resp_buf, array_ticket);
+	blobmsg_close_array(resp_buf, array_ticket);
+}
+
+char* jsonrpc__resp_ubus(struct blob_attr *id, int ubus_rc, struct blob_attr *ret_data)
+{
+	struct blob_buf resp_buf = {};
+	jsonrpc__resp_ubus_blob(&resp_buf, id, ubus_rc, ret_data);
 
 	char *ret = blobmsg_format_json(resp_buf.head, true);
 	blob_buf_free(&resp_buf);
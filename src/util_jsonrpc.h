@@ -36,18 +36,52 @@ enum jsonrpc_error_code {
 	JSONRPC_ERRORCODE__OTHER            = -32050,
 };
 
+/** \brief JSON text every response starts with, id value comes next */
+#define JSONRPC_RESP_PREFIX "{\"jsonrpc\":\"2.0\",\"id\":"
+
+/**
+ * \brief pre-rendered rest of Error response after the id, for standard error
+ * code without extra data
+ *
+ * \param error_code one of jsonrpc_error_code values
+ * \param len where to store length of returned text
+ *
+ * @return text which completes the response, or NULL if not available
+ */
+const char *jsonrpc__resp_error_suffix(int error_code, size_t *len);
+
+/**
+ * \brief pre-rendered rest of result response after the id, for ubus status
+ * without data: ,"result":[<ubus_rc>]}
+ *
+ * @return text which completes the response, or NULL if not available
+ */
+const char *jsonrpc__resp_status_suffix(int ubus_rc, size_t *len);
+
 /**
  * \brief construct Error response with given id, code, and extra informational
  * data; code should be one of the known jsonrpc_error_code enum values
  */
 char* jsonrpc__resp_error(struct blob_attr *id, int error_code, struct blob_attr *error_data);
 
+/**
+ * \brief same as jsonrpc__resp_error, but (re)initializes resp_buf with the
+ * response as blobmsg instead of formatting it to JSON
+ */
+void jsonrpc__resp_error_blob(struct blob_buf *resp_buf, struct blob_attr *id, int error_code, struct blob_attr *error_data);
+
 /**
  * \brief construct jsonrpc result response of the form
  * {"jsonrpc":"2.0","id":<id>,"result":[<ubus_rc>,<ret_data>]}
  */
 char* jsonrpc__resp_ubus(struct blob_attr *id, int ubus_rc, struct blob_attr *ret_data);
 
+/**
+ * \brief same as jsonrpc__resp_ubus, but (re)initializes resp_buf with the
+ * response as blobmsg instead of formatting it to JSON
+ */
+void jsonrpc__resp_ubus_blob(struct blob_buf *resp_buf, struct blob_attr *id, int ubus_rc, struct blob_attr *ret_data);
+
 /**
  * \brief construct jsonrpc call message for `ubus list` via RPC
  * {"jsonrpc":"2.0","id":<id>,"method":"list",[<sid>,<pattern>]}
@@ -52,3 +52,34 @@ static inline const char *blobmsg_type_to_str(enum blobmsg_type t)
 	return lookup[t];
 }
 
+
+/**
+ * \brief check that area holds only well-formed blobmsg attributes, including
+ * the contents of nested tables and arrays
+ *
+ * \param data start of attributes, e.g. blob_data of the parent
+ * \param len length of the area
+ * \param name true if attributes must be named (members of table)
+ * \param depth how many more nesting levels are allowed
+ */
+static inline bool blobmsg_check_nested(const void *data, unsigned int len, bool name, int depth)
+{
+	const struct blob_attr *cur;
+	unsigned int rem = len;
+
+	if (depth < 0)
+		return false;
+
+	__blob_for_each_attr(cur, data, rem) {
+		if (!blob_is_extended(cur) || !blobmsg_check_attr(cur, name))
+			return false;
+
+		int type = blobmsg_type(cur);
+		if ((type == BLOBMSG_TYPE_TABLE || type == BLOBMSG_TYPE_ARRAY)
+				&& !blobmsg_check_nested(blobmsg_data(cur), (unsigned)blobmsg_data_len(cur), type == BLOBMSG_TYPE_TABLE, depth - 1))
+			return false;
+	}
+
+	// anything left over is garbage, not an attribute
+	return rem == 0;
+}
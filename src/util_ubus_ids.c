@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * cache of ubus object ids owsd looks up for its own use
+ */
+#include "util_ubus_ids.h"
+#include "common.h"
+
+#include <libubus.h>
+#include <libubox/blobmsg.h>
+#include <libubox/list.h>
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * \brief object owsd talks to; only few are, so they are kept in a list
+ */
+struct wsu_ubus_id {
+	struct list_head list;
+	uint32_t id;
+	// false until looked up, and after object is removed
+	bool valid;
+	char path[];
+};
+
+static LIST_HEAD(ubus_ids);
+
+static struct ubus_event_handler object_ev_handler;
+
+static struct wsu_ubus_id *ubus_id_find(const char *path)
+{
+	struct wsu_ubus_id *e;
+	list_for_each_entry(e, &ubus_ids, list)
+		if (!strcmp(e->path, path))
+			return e;
+	return NULL;
+}
+
+static void ubus_ids_on_object_ev(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type, struct blob_attr *msg)
+{
+	(void)ctx; (void)ev;
+
+	enum { OBJ_EV_ID, OBJ_EV_PATH };
+	static const struct blobmsg_policy policy[] = {
+		[OBJ_EV_ID]   = { .name = "id",   .type = BLOBMSG_TYPE_INT32 },
+		[OBJ_EV_PATH] = { .name = "path", .type = BLOBMSG_TYPE_STRING },
+	};
+	struct blob_attr *tb[ARRAY_SIZE(policy)];
+
+	blobmsg_parse(policy, ARRAY_SIZE(policy), tb, blob_data(msg), blob_len(msg));
+	if (!tb[OBJ_EV_ID] || !tb[OBJ_EV_PATH])
+		return;
+
+	struct wsu_ubus_id *e = ubus_id_find(blobmsg_get_string(tb[OBJ_EV_PATH]));
+	if (!e)
+		return;
+
+	uint32_t id = blobmsg_get_u32(tb[OBJ_EV_ID]);
+	if (!strcmp(type, "ubus.object.add")) {
+		lwsl_info("ubus object %s added with id %08x\n", e->path, id);
+		e->id = id;
+		e->valid = true;
+	} else if (!strcmp(type, "ubus.object.remove") && e->id == id) {
+		lwsl_info("ubus object %s removed\n", e->path);
+		e->valid = false;
+	}
+}
+
+int wsu_ubus_ids_init(struct ubus_context *ctx)
+{
+	object_ev_handler.cb = ubus_ids_on_object_ev;
+	int ret = ubus_register_event_handler(ctx, &object_ev_handler, "ubus.object.*");
+	if (ret)
+		lwsl_err("ubus reg evh for object ids error %s\n", ubus_strerror(ret));
+	return ret;
+}
+
+int wsu_ubus_id_lookup(struct ubus_context *ctx, const char *path, uint32_t *id)
+{
+	struct wsu_ubus_id *e = ubus_id_find(path);
+
+	if (e && e->valid) {
+		*id = e->id;
+		return UBUS_STATUS_OK;
+	}
+
+	int ret = ubus_lookup_id(ctx, path, id);
+	if (ret != UBUS_STATUS_OK)
+		return ret;
+
+	if (!e) {
+		e = malloc(sizeof *e + strlen(path) + 1);
+		if (!e)
+			return UBUS_STATUS_OK;
+		strcpy(e->path, path);
+		list_add_tail(&e->list, &ubus_ids);
+	}
+
+	e->id = *id;
+	e->valid = true;
+	return UBUS_STATUS_OK;
+}
+
+bool wsu_ubus_id_cached(const char *path, uint32_t *id)
+{
+	struct wsu_ubus_id *e = ubus_id_find(path);
+
+	if (!e || !e->valid)
+		return false;
+
+	*id = e->id;
+	return true;
+}
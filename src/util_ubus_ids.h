@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2017 Inteno Broadband Technology AB. All rights reserved.
+ *
+ * Author: Denis Osvald <denis.osvald@sartura.hr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+/*
+ * cache of ubus object ids owsd looks up for its own use
+ *
+ * Ids are resolved once and then kept up to date from ubus.object.add and
+ * ubus.object.remove events, so lookups don't block the event loop on ubusd
+ * every time, and restart of the object's owner (e.g. rpcd) is noticed.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct ubus_context;
+
+/**
+ * \brief start following object add/remove events which keep ids up to date
+ *
+ * @return 0 if succeeded
+ */
+int wsu_ubus_ids_init(struct ubus_context *ctx);
+
+/**
+ * \brief resolve id of object by its path, from cache if possible
+ *
+ * @return UBUS_STATUS_OK, or error status if object was not found
+ */
+int wsu_ubus_id_lookup(struct ubus_context *ctx, const char *path, uint32_t *id);
+
+/**
+ * \brief get id of object from cache only, never asking ubusd
+ *
+ * @return true if id is known and object was not removed since
+ */
+bool wsu_ubus_id_cached(const char *path, uint32_t *id);
@@ -28,6 +28,7 @@
 #include "rpc.h"
 #include "access_check.h"
 #include "util_jsonrpc.h"
+#include "util_ubus_blob.h"
 
 #include <json-c/json.h>
 #include <libubox/blobmsg_json.h>
@@ -42,16 +43,38 @@
 
 static lws_callback_function wsubus_cb;
 
+// lws receive buffer, allocated for each connection. Messages bigger than this
+// arrive in several pieces and are collected in buffers which grow as needed,
+// so this is kept small for many mostly idle connections
+#define WSUBUS_RX_BUFFER_SIZE 4096
+
 /** protocol + callback for RPC server */
 struct lws_protocols wsubus_proto = {
 	WSUBUS_PROTO_NAME,
 	wsubus_cb,
 	sizeof (struct wsu_peer),
-	32768,    //3000 // arbitrary length
+	WSUBUS_RX_BUFFER_SIZE,
+	0,    // - id
+	NULL, // - user pointer
+};
+
+/** protocol + callback for RPC server, with blobmsg messages instead of JSON */
+struct lws_protocols wsubus_blob_proto = {
+	WSUBUS_BLOB_PROTO_NAME,
+	wsubus_cb,
+	sizeof (struct wsu_peer),
+	WSUBUS_RX_BUFFER_SIZE,
 	0,    // - id
 	NULL, // - user pointer
 };
 
+// binary message buffer bigger than this is not kept around for next message
+#define WSUBUS_BLOB_KEEP_BUFLEN 65536
+
+// room kept free after each received request, so that RPCs can append to
+// their params in place (e.g. ubus_rpc_session and _owsd_listen for call)
+#define WSUBUS_MSG_TAIL_RESERVE 128
+
 /*
  * WebSocket connections coming in from browser are not subject to same origin
  * policy, which means any site's JS can connect to any websocket Since we are
@@ -119,44 +142,137 @@ static int wsubus_filter(struct lws *wsi)
 	return rc;
 }
 
+#ifndef LWS_NO_EXTENSIONS
+/**
+ * \brief return nonzero if extension the client offered is not to be used on
+ * this connection. Compression is only worth it for JSON text, and number of
+ * connections holding zlib streams is limited
+ */
+static int wsubus_confirm_ext(struct lws *wsi, struct wsu_peer *peer, const char *ext_name)
+{
+	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+
+	if (strcmp(ext_name, "permessage-deflate"))
+		return 0;
+
+	if (strcmp(lws_get_protocol(wsi)->name, WSUBUS_PROTO_NAME))
+		return 1;
+
+	if (prog->deflate_peers >= prog->deflate_peers_max) {
+		lwsl_info("%u connections use compression already, not compressing\n", prog->deflate_peers);
+		return 1;
+	}
+
+	// peer is set up later, on established
+	peer->deflate = true;
+	return 0;
+}
+
+/**
+ * \brief tune compression of connection which negotiated permessage-deflate
+ */
+static void wsubus_deflate_init(struct lws *wsi, struct vh_context *vc)
+{
+	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+	char val[8];
+
+	++prog->deflate_peers;
+	if (!vc)
+		return;
+
+	// zlib streams are set up on first message, so these still apply; our
+	// compression window may be smaller than what was negotiated
+	snprintf(val, sizeof val, "%d", vc->deflate.window_bits);
+	lws_set_extension_option(wsi, "permessage-deflate", "server_max_window_bits", val);
+	snprintf(val, sizeof val, "%d", vc->deflate.mem_level);
+	lws_set_extension_option(wsi, "permessage-deflate", "mem_level", val);
+}
+#endif // LWS_NO_EXTENSIONS
+
+/**
+ * \brief make sure there is room for WSUBUS_MSG_TAIL_RESERVE bytes after the
+ * message in its buffer. Buffer is reallocated only if needed.
+ *
+ * @return the message, possibly moved, or NULL if it was freed on failure
+ */
+static struct blob_attr *wsu_msg_reserve_tail(struct blob_attr *blob, size_t *size)
+{
+	size_t len = blob_pad_len(blob);
+	if (*size >= len + WSUBUS_MSG_TAIL_RESERVE)
+		return blob;
+
+	struct blob_attr *ret = realloc(blob, len + WSUBUS_MSG_TAIL_RESERVE);
+	if (!ret) {
+		free(blob);
+		return NULL;
+	}
+
+	*size = len + WSUBUS_MSG_TAIL_RESERVE;
+	return ret;
+}
+
 /**
  * \brief process one complete JSON RPC message (in blob) from client
+ *
+ * \param blob message; start of malloc'd buffer which this function takes
+ * over, it is either handed to the RPC as src_blob or freed
+ * \param size allocated size of the buffer
+ * \param batch if message is an element of batch request, the batch, which
+ * has been counted in as waiting for the reply to this message
  */
 static void wsu_on_msg_from_client(struct lws *wsi,
-		struct blob_attr *blob)
+		struct blob_attr *blob,
+		size_t size,
+		struct wsu_batch *batch)
 {
 	const struct wsu_client_session *client = wsi_to_client(wsi);
 	lwsl_info("client %u handling blobmsg buf\n", client->id);
 	(void)client;
 
-	struct jsonrpc_blob_req *jsonrpc_req = malloc(sizeof *jsonrpc_req);
+	struct jsonrpc_blob_req jsonrpc_req = {};
 	struct ubusrpc_blob *ubusrpc_req = NULL;
 	int e = 0;
-	if (!jsonrpc_req) {
-		// free of NULL is no-op so okay
-		lwsl_err("failed to alloc\n");
-		e = JSONRPC_ERRORCODE__INTERNAL_ERROR;
-		goto out;
-	}
 
 	// parse the JSON-RPC part of message
-	if (jsonrpc_blob_req_parse(jsonrpc_req, blob) != 0) {
+	if (jsonrpc_blob_req_parse(&jsonrpc_req, blob) != 0) {
 		lwsl_info("blobmsg not valid jsonrpc\n");
 		e = JSONRPC_ERRORCODE__INVALID_REQUEST;
 		goto out;
 	}
 
+	// notification in a batch gets no reply, not even an error; it runs like
+	// other requests, but its reply goes to a batch of its own which is
+	// dropped, and the batch it came in doesn't wait for it
+	if (batch && !jsonrpc_req.id) {
+		struct wsu_batch *quiet = wsu_batch_new(wsi);
+		if (quiet) {
+			quiet->quiet = true;
+			wsu_batch_put(wsi, batch);
+			batch = quiet;
+		}
+	}
+
+	// params may be appended to in place if they are at the very end of message
+	size_t tailroom = 0;
+	if ((char *)jsonrpc_req.params + blob_pad_len(jsonrpc_req.params) == (char *)blob + blob_pad_len(blob))
+		tailroom = size - blob_pad_len(blob);
+
 	// parse the RPC method-specific arguments and other data
-	ubusrpc_req = ubusrpc_blob_parse(jsonrpc_req->method, jsonrpc_req->params, &e);
+	ubusrpc_req = ubusrpc_blob_parse(jsonrpc_req.method, jsonrpc_req.params, tailroom, &e);
 	if (!ubusrpc_req) {
 		lwsl_info("not valid ubus rpc in jsonrpc %d\n", e);
 		goto out;
 	}
 
+	// parsed data points into the message, so from now on RPC owns it
+	ubusrpc_req->src_blob = blob;
+	blob = NULL;
+
 	wsu_sid_update(wsi_to_peer(wsi), ubusrpc_req->sid);
+	ubusrpc_req->batch = batch;
 
 	// call handler which was set by parse function
-	if (ubusrpc_req->handler(wsi, ubusrpc_req, jsonrpc_req->id) != 0) {
+	if (ubusrpc_req->handler(wsi, ubusrpc_req, jsonrpc_req.id) != 0) {
 		lwsl_info("ubusrpc method handler failed\n");
 		e = JSONRPC_ERRORCODE__OTHER;
 		goto out;
@@ -166,9 +282,7 @@ out:
 	// send jsonrpc error code if we failed...
 	// otherwise handler itself is in charge of sending reply
 	if (e) {
-		char *json_str = jsonrpc__resp_error(jsonrpc_req ? jsonrpc_req->id : NULL, e, NULL);
-		wsu_queue_write_str(wsi, json_str);
-		free(json_str);
+		wsu_reply_error(wsi, batch, jsonrpc_req.id, e, NULL);
 		if (ubusrpc_req) {
 			if (ubusrpc_req->destroy)
 				ubusrpc_req->destroy(ubusrpc_req);
@@ -177,15 +291,83 @@ out:
 		}
 	}
 
-	free(jsonrpc_req);
+	free(blob);
 	return;
 }
 
+/**
+ * \brief process JSON-RPC batch request (array of messages) from client
+ *
+ * Each element is dispatched to its handler right away, so they run
+ * concurrently, and replies are sent in one array once all are done.
+ */
+static void wsu_on_batch_from_client(struct lws *wsi,
+		struct blob_attr *blob)
+{
+	const struct wsu_client_session *client = wsi_to_client(wsi);
+	lwsl_info("client %u handling batch of len %u\n", client->id, (unsigned)blob_len(blob));
+	(void)client;
+
+	struct wsu_batch *batch = NULL;
+	int e = 0;
+
+	if (!blob_len(blob)) {
+		// empty batch is answered with single error, not with array
+		e = JSONRPC_ERRORCODE__INVALID_REQUEST;
+		goto out;
+	}
+
+	batch = wsu_batch_new(wsi);
+	if (!batch) {
+		lwsl_err("failed to alloc batch\n");
+		e = JSONRPC_ERRORCODE__INTERNAL_ERROR;
+		goto out;
+	}
+
+	struct blob_attr *cur;
+	unsigned int rem = blob_len(blob);
+	__blob_for_each_attr(cur, blob_data(blob), rem) {
+		++batch->pending;
+		if (blobmsg_type(cur) != BLOBMSG_TYPE_TABLE) {
+			wsu_reply_error(wsi, batch, NULL, JSONRPC_ERRORCODE__INVALID_REQUEST, NULL);
+			continue;
+		}
+
+		// elements share the buffer, so each one gets its own copy to keep
+		size_t size = blob_pad_len(cur) + WSUBUS_MSG_TAIL_RESERVE;
+		struct blob_attr *msg = malloc(size);
+		if (!msg) {
+			lwsl_err("failed to alloc batch element\n");
+			wsu_reply_error(wsi, batch, NULL, JSONRPC_ERRORCODE__INTERNAL_ERROR, NULL);
+			continue;
+		}
+		memcpy(msg, cur, blob_pad_len(cur));
+
+		wsu_on_msg_from_client(wsi, msg, size, batch);
+	}
+
+	// replies which were done synchronously are collected, send if all are
+	wsu_batch_put(wsi, batch);
+
+out:
+	if (e) {
+		wsu_reply_error(wsi, NULL, NULL, e, NULL);
+	}
+}
+
 static void wsu_read_reset(struct wsu_peer *peer)
 {
 	peer->curr_msg.len = 0;
 
-	json_tokener_reset(peer->curr_msg.jtok);
+	if (peer->curr_msg.buf_alloc > WSUBUS_BLOB_KEEP_BUFLEN) {
+		free(peer->curr_msg.buf);
+		peer->curr_msg.buf = NULL;
+		peer->curr_msg.buf_alloc = 0;
+	}
+
+	// idle connections keep no parser state
+	json_blob_parser_pool_put(peer->curr_msg.parser);
+	peer->curr_msg.parser = NULL;
 }
 
 /**
@@ -199,37 +381,54 @@ static void wsubus_rx_json(struct lws *wsi,
 	int is_final_frame = lws_is_final_fragment(wsi);
 	struct wsu_peer *peer = wsi_to_peer(wsi);
 
+	if (peer->binary) {
+		lwsl_err("text message on " WSUBUS_BLOB_PROTO_NAME " protocol, ignoring\n");
+		if (!remaining_bytes_in_frame && is_final_frame)
+			wsu_read_reset(peer);
+		return;
+	}
+
 	assert(len < INT32_MAX);
-	peer->curr_msg.len += len;
 
-	// feed in the newly-received text into json parser
-	struct json_object *jobj = json_tokener_parse_ex(peer->curr_msg.jtok, in, (int)len);
+	if (!peer->curr_msg.parser && !(peer->curr_msg.parser = json_blob_parser_pool_get())) {
+		lwsl_err("failed to get json parser, dropping msg\n");
+		wsu_reply_error(wsi, NULL, NULL, JSONRPC_ERRORCODE__INTERNAL_ERROR, NULL);
+		// TODO<lwsclose> check
+		shutdown(lws_get_socket_fd(wsi), SHUT_RDWR);
+		return;
+	}
+
+	peer->curr_msg.len += len;
 
-	enum json_tokener_error tok_error = json_tokener_get_error(peer->curr_msg.jtok);
-	int parsed_to = peer->curr_msg.jtok->char_offset;
+	// feed in the newly-received text into json parser, which builds the
+	// blobmsg as it goes, so there is no json_object tree to convert later
+	enum json_blob_status st = json_blob_parser_feed(peer->curr_msg.parser, in, len);
 
 	if (!remaining_bytes_in_frame && is_final_frame) {
-		if (parsed_to == (int)len && jobj && json_object_is_type(jobj, json_type_object)) {
+		int type = json_blob_parser_type(peer->curr_msg.parser);
+		if (st == JSON_BLOB_DONE && type == BLOBMSG_TYPE_TABLE) {
 			// message is finished and parser has successfully parsed everything
-			struct blob_buf blob = {};
-			blob_buf_init(&blob, 0);
-			blobmsg_add_object(&blob, jobj);
-			wsu_on_msg_from_client(wsi, blob.head);
-			blob_buf_free(&blob);
+			size_t size;
+			struct blob_attr *msg = json_blob_parser_steal(peer->curr_msg.parser, &size);
+			if ((msg = wsu_msg_reserve_tail(msg, &size)))
+				wsu_on_msg_from_client(wsi, msg, size, NULL);
+			else
+				wsu_reply_error(wsi, NULL, NULL, JSONRPC_ERRORCODE__INTERNAL_ERROR, NULL);
+		} else if (st == JSON_BLOB_DONE && type == BLOBMSG_TYPE_ARRAY) {
+			wsu_on_batch_from_client(wsi, json_blob_parser_result(peer->curr_msg.parser));
 		} else {
 			// parse error -> we just ignore the message
-			lwsl_err("json parsing error %s, at char %d of %zu, dropping msg\n",
-					json_tokener_error_desc(tok_error), parsed_to, len);
-			char *resp = jsonrpc__resp_error(NULL, JSONRPC_ERRORCODE__PARSE_ERROR, NULL);
-			wsu_queue_write_str(wsi, resp);
-			free(resp);
+			lwsl_err("json parsing error %s, at char %zu of %zu, dropping msg\n",
+					st == JSON_BLOB_CONTINUE ? "unexpected end of message" : json_blob_parser_error_desc(peer->curr_msg.parser),
+					json_blob_parser_offset(peer->curr_msg.parser), peer->curr_msg.len);
+			wsu_reply_error(wsi, NULL, NULL, JSONRPC_ERRORCODE__PARSE_ERROR, NULL);
 		}
 		wsu_read_reset(peer);
 	} else {
-		if (tok_error != json_tokener_continue) {
+		if (st == JSON_BLOB_ERROR) {
 			// parse error mid-message, client will send more data
 			// For now we drop the client, but we could mark state and skip only this message
-			lwsl_err("unexpected json parsing error %s\n", json_tokener_error_desc(tok_error));
+			lwsl_err("unexpected json parsing error %s\n", json_blob_parser_error_desc(peer->curr_msg.parser));
 			lwsl_err("Dropping client\n");
 
 			// TODO<lwsclose> check
@@ -237,18 +436,100 @@ static void wsubus_rx_json(struct lws *wsi,
 			shutdown(lws_get_socket_fd(wsi), SHUT_RDWR);
 		}
 	}
-
-	if (jobj)
-		json_object_put(jobj);
 }
 
+/**
+ * \brief receive a binary message part from websocket
+ *
+ * Binary message is a blob as made by blob_buf_init + blobmsg_add_*, same as
+ * we would get by parsing the JSON text. If id of the root attribute is
+ * BLOBMSG_TYPE_ARRAY it is a batch and its elements are the requests,
+ * otherwise the root holds fields of a single request.
+ */
 static void wsubus_rx_blob(struct lws *wsi,
 		const char *in,
 		size_t len)
 {
-	// TODO implement
-	lwsl_err("Binary (blobmsg) not implemented %p %p %zu\n", wsi, in, len);
-	// for now just do nothing with binary message
+	size_t remaining_bytes_in_frame = lws_remaining_packet_payload(wsi);
+	int is_final_frame = lws_is_final_fragment(wsi);
+	struct wsu_peer *peer = wsi_to_peer(wsi);
+
+	if (!peer->binary) {
+		lwsl_err("binary message on " WSUBUS_PROTO_NAME " protocol, ignoring\n");
+		if (!remaining_bytes_in_frame && is_final_frame)
+			wsu_read_reset(peer);
+		return;
+	}
+
+	// grow by what was actually received, rather than what the frame header
+	// announces, and rx checked the total against max message length already
+	size_t need = peer->curr_msg.len + len;
+	if (need > peer->curr_msg.buf_alloc) {
+		size_t alloc = peer->curr_msg.buf_alloc ? peer->curr_msg.buf_alloc : 1024;
+		while (alloc < need)
+			alloc *= 2;
+
+		unsigned char *buf = realloc(peer->curr_msg.buf, alloc);
+		if (!buf) {
+			lwsl_err("failed to alloc blob message buf of %zu\n", alloc);
+			lwsl_err("Dropping client\n");
+
+			// TODO<lwsclose> check
+			// stop reading and writing
+			shutdown(lws_get_socket_fd(wsi), SHUT_RDWR);
+			return;
+		}
+		peer->curr_msg.buf = buf;
+		peer->curr_msg.buf_alloc = alloc;
+	}
+
+	memcpy(peer->curr_msg.buf + peer->curr_msg.len, in, len);
+	peer->curr_msg.len += len;
+
+	if (remaining_bytes_in_frame || !is_final_frame)
+		return;
+
+	struct blob_attr *root = (struct blob_attr *)peer->curr_msg.buf;
+	size_t msg_len = peer->curr_msg.len;
+	bool batch = false;
+
+	// root length below its own header would make blob_len wrap around
+	if (msg_len < sizeof *root || blob_raw_len(root) < sizeof *root ||
+			blob_raw_len(root) > msg_len || blob_pad_len(root) < msg_len) {
+		lwsl_err("blob message of len %zu is truncated or has trailing data\n", msg_len);
+		goto parse_error;
+	}
+
+	batch = blob_id(root) == BLOBMSG_TYPE_ARRAY;
+	if (!batch && blob_id(root) != BLOBMSG_TYPE_TABLE) {
+		lwsl_err("blob message root has id %u, not table or array\n", blob_id(root));
+		goto parse_error;
+	}
+	if (!blobmsg_check_nested(blob_data(root), blob_len(root), !batch, JSON_BLOB_MAX_DEPTH)) {
+		lwsl_err("blob message of len %zu is not valid blobmsg\n", msg_len);
+		goto parse_error;
+	}
+
+	if (batch) {
+		wsu_on_batch_from_client(wsi, root);
+	} else {
+		// message buffer is handed over with the message
+		size_t size = peer->curr_msg.buf_alloc;
+		peer->curr_msg.buf = NULL;
+		peer->curr_msg.buf_alloc = 0;
+
+		if ((root = wsu_msg_reserve_tail(root, &size)))
+			wsu_on_msg_from_client(wsi, root, size, NULL);
+		else
+			wsu_reply_error(wsi, NULL, NULL, JSONRPC_ERRORCODE__INTERNAL_ERROR, NULL);
+	}
+
+	wsu_read_reset(peer);
+	return;
+
+parse_error:
+	wsu_reply_error(wsi, NULL, NULL, JSONRPC_ERRORCODE__PARSE_ERROR, NULL);
+	wsu_read_reset(peer);
 }
 
 static void wsubus_rx(struct lws *wsi,
@@ -263,22 +544,35 @@ static void wsubus_rx(struct lws *wsi,
 	lwsl_info("peer IO: msg final %d, len was %zu , remaining %zu\n", is_final_frame, len, remaining_bytes_in_frame);
 	(void)is_final_frame;
 
-	if (len > WSUBUS_MAX_MESSAGE_LEN || remaining_bytes_in_frame > WSUBUS_MAX_MESSAGE_LEN ||
-			peer->curr_msg.len + len + remaining_bytes_in_frame > WSUBUS_MAX_MESSAGE_LEN) {
+	if (len > peer->max_frame_len || remaining_bytes_in_frame > peer->max_frame_len ||
+			peer->curr_msg.frame_len + len + remaining_bytes_in_frame > peer->max_frame_len) {
+		lwsl_err("peer IO: received fragment of frame (%zu total) making frame too long\n",
+				peer->curr_msg.frame_len + len + remaining_bytes_in_frame);
+		goto too_long;
+	}
+
+	if (len > peer->max_msg_len || remaining_bytes_in_frame > peer->max_msg_len ||
+			peer->curr_msg.len + len + remaining_bytes_in_frame > peer->max_msg_len) {
 		// client intends to send too mush data, we will drop them
 		lwsl_err("peer IO: received fragment of frame (%zu total) making msg too long\n",
 				len + remaining_bytes_in_frame);
-
-		// TODO<lwsclose> check
-		// stop reading from mad client
-		shutdown(lws_get_socket_fd(wsi), SHUT_RD);
+		goto too_long;
 	}
 
+	peer->curr_msg.frame_len = remaining_bytes_in_frame ? peer->curr_msg.frame_len + len : 0;
+
 	if (lws_frame_is_binary(wsi)) {
 		wsubus_rx_blob(wsi, in, len);
 	} else {
 		wsubus_rx_json(wsi, in, len);
 	}
+	return;
+
+too_long:
+	// TODO<lwsclose> check
+	// stop reading from mad client, and don't buffer what was received
+	shutdown(lws_get_socket_fd(wsi), SHUT_RD);
+	wsu_read_reset(peer);
 }
 
 static int wsubus_cb(struct lws *wsi,
@@ -297,10 +591,28 @@ static int wsubus_cb(struct lws *wsi,
 			return -1;
 		return 0;
 
+#ifndef LWS_NO_EXTENSIONS
+	case LWS_CALLBACK_CONFIRM_EXTENSION_OKAY:
+		return wsubus_confirm_ext(wsi, peer, in);
+#endif
+
 	case LWS_CALLBACK_ESTABLISHED:
 		lwsl_notice(WSUBUS_PROTO_NAME ": established\n");
 		if (0 != wsu_peer_init(peer, WSUBUS_ROLE_CLIENT))
 			return -1;
+		peer->binary = !strcmp(lws_get_protocol(wsi)->name, WSUBUS_BLOB_PROTO_NAME);
+		wsubus_access_tls_init(wsi);
+		{
+			struct vh_context *vc = *(struct vh_context**)lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
+			if (vc) {
+				peer->max_msg_len = vc->max_msg_len;
+				peer->max_frame_len = vc->max_frame_len;
+			}
+#ifndef LWS_NO_EXTENSIONS
+			if (peer->deflate)
+				wsubus_deflate_init(wsi, vc);
+#endif
+		}
 		break;
 
 		// read/write
@@ -22,6 +22,7 @@
 #include "owsd-config.h"
 
 extern struct lws_protocols wsubus_proto;
+extern struct lws_protocols wsubus_blob_proto;
 
 #if WSD_HAVE_UBUSPROXY
 extern struct lws_protocols ws_ubusproxy_proto;
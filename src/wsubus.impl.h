@@ -32,15 +32,19 @@
 #endif
 
 #include "access_check.h"
+#include "util_json_blob.h"
+#include "util_blob_json.h"
 
 #include <stddef.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <strings.h>
 
-#include <json-c/json.h>
 #include <libubox/list.h>
+#include <libubox/avl.h>
+#include <libubox/avl-cmp.h>
 #include <libubox/blobmsg.h>
+#include <libubox/blobmsg_json.h>
 #include <libwebsockets.h>
 
 #if WSD_HAVE_UBUSPROXY
@@ -48,6 +52,8 @@
 #endif
 
 #define WSUBUS_PROTO_NAME "ubus-json"
+// same RPCs as above, but messages are blobmsg in binary frames, not JSON
+#define WSUBUS_BLOB_PROTO_NAME "ubus-blob"
 #define WSUBUS_MAX_MESSAGE_LEN (1 << 27) // 128M
 
 #define UBUS_DEFAULT_SID "00000000000000000000000000000000"
@@ -55,6 +61,12 @@
 
 #define MAX_PROXIED_CALLS 20
 
+// call results at least this big are sent in fragments of about this size,
+// at most this many queued at a time, see wsu_stream
+#define WSUBUS_STREAM_MIN_LEN (64 * 1024)
+#define WSUBUS_STREAM_FRAG_LEN (16 * 1024)
+#define WSUBUS_STREAM_FRAG_QUEUED 2
+
 /**
  * \brief lws allocates one instance of this for each websocket connection
  *
@@ -63,10 +75,42 @@
 struct wsu_peer {
 	// I/O
 	struct {
-		struct json_tokener *jtok;
+		// taken from parser pool while text message is being received
+		struct json_blob_parser *parser;
 		size_t len;
+		// how much of current frame was received so far
+		size_t frame_len;
+		// binary message is collected here until the last fragment
+		unsigned char *buf;
+		size_t buf_alloc;
 	} curr_msg; // read
 	struct list_head write_q; // write
+	size_t write_q_len; // bytes in write_q
+	bool rx_paused; // reading was stopped since write_q was over budget
+	bool write_closed; // connection was dropped, nothing more is queued
+	// while fragmented message is being queued, its next fragment goes after
+	// this entry, ahead of messages queued in the meantime; NULL otherwise
+	struct list_head *stream_pos;
+	// message whose fragments are produced as earlier ones are written
+	struct wsu_stream *stream;
+	unsigned int stream_frags; // its fragments in write_q
+
+	// peer negotiated WSUBUS_BLOB_PROTO_NAME, all messages are blobmsg
+	bool binary;
+
+	// peer negotiated permessage-deflate, set already before init
+	bool deflate;
+
+	// receive limits, taken from vhost the peer connected to
+	size_t max_msg_len;
+	size_t max_frame_len;
+
+	// verdict on TLS client certificate, found once at handshake
+	enum wsu_tls_cert {
+		WSU_TLS_CERT_NONE, // connection is not TLS
+		WSU_TLS_CERT_VALID,
+		WSU_TLS_CERT_INVALID, // missing or not verified
+	} tls_cert;
 
 	char sid[UBUS_SID_MAX_STRLEN + 1];
 
@@ -88,6 +132,10 @@ struct wsu_peer {
 			// used to track/cancel the long-lived handles or async requests
 			struct list_head rpc_call_q;
 			struct list_head access_check_q;
+			// batch requests still waiting for some of the replies
+			struct list_head batch_q;
+			// own event subscriptions, by pattern
+			struct avl_tree subs;
 		} client;
 #if WSD_HAVE_UBUSPROXY
 		/**
@@ -192,15 +240,242 @@ struct wsubus_client_access_check_ctx {
 };
 
 //{{{ I/O handling
+/**
+ * \brief immutable text shared by write requests to many peers, e.g. event
+ * notification which goes to all subscribers. Laid out like write request,
+ * with LWS padding around the text
+ */
+struct wsu_shared_buf {
+	unsigned int refcount;
+	size_t len;
+
+	unsigned char buf[0];
+};
+
+static inline void wsu_shared_buf_json_out_init(struct json_out *o)
+{
+	json_out_init(o, sizeof(struct wsu_shared_buf) + LWS_SEND_BUFFER_PRE_PADDING, LWS_SEND_BUFFER_POST_PADDING);
+}
+
+/**
+ * \brief take over text written to output prepared by
+ * wsu_shared_buf_json_out_init, with one reference held by the caller
+ *
+ * @return shared text, or NULL if writing it failed
+ */
+static inline struct wsu_shared_buf *wsu_shared_buf_from_json(struct json_out *o)
+{
+	if (o->error || !o->buf) {
+		json_out_free(o);
+		return NULL;
+	}
+
+	size_t len = o->len;
+	struct wsu_shared_buf *s = (struct wsu_shared_buf *)json_out_steal(o);
+	s->refcount = 1;
+	s->len = len;
+	return s;
+}
+
+static inline struct wsu_shared_buf *wsu_shared_buf_get(struct wsu_shared_buf *s)
+{
+	++s->refcount;
+	return s;
+}
+
+static inline void wsu_shared_buf_put(struct wsu_shared_buf *s)
+{
+	if (s && !--s->refcount)
+		free(s);
+}
+
 struct wsu_writereq {
+	// whole message, including shared text
 	size_t len;
 	size_t written;
 
+	// if set, message starts with this text, and buf holds the rest
+	struct wsu_shared_buf *shared;
+
+	// event notification, which may be dropped if peer can't keep up
+	bool event;
+	// fragment of message: continues previous one / more fragments follow
+	bool cont;
+	bool more;
+
 	struct list_head wq;
 
 	unsigned char buf[0];
 };
 
+static inline void wsu_writereq_free(struct wsu_writereq *w)
+{
+	wsu_shared_buf_put(w->shared);
+	free(w);
+}
+
+/**
+ * \brief remove write request from peer's queue and free it
+ */
+static inline void wsu_writereq_done(struct lws *wsi, struct wsu_peer *peer, struct wsu_writereq *w)
+{
+	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+
+	if (peer->stream_pos == &w->wq)
+		peer->stream_pos = &peer->write_q;
+	if (w->cont || w->more)
+		--peer->stream_frags;
+
+	list_del(&w->wq);
+	peer->write_q_len -= w->len;
+	prog->write_q_total -= w->len;
+	wsu_writereq_free(w);
+}
+
+static inline bool wsu_write_q_over(struct prog_context *prog, struct wsu_peer *peer, struct wsu_writereq *last)
+{
+	return peer->write_q_len > last->len &&
+		(peer->write_q_len > prog->write_q_max || prog->write_q_total > prog->write_q_max_total);
+}
+
+/**
+ * \brief apply overflow policy after peer's write queue went over budget
+ *
+ * The message just queued is exempt, so that a single big reply always goes
+ * out, and replies are never dropped since client waits for them.
+ */
+static inline void wsu_write_q_overflow(struct lws *wsi, struct wsu_peer *peer, struct wsu_writereq *last)
+{
+	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+	struct wsu_writereq *w, *n;
+
+	if (!wsu_write_q_over(prog, peer, last))
+		return;
+
+	switch (prog->write_q_policy) {
+	case WSD_WRITE_Q_PAUSE:
+		if (!peer->rx_paused) {
+			lwsl_warn("write queue %zu over budget, pausing reading from peer (%lu paused so far)\n",
+					peer->write_q_len, ++prog->write_q_stats.paused_peers);
+			peer->rx_paused = true;
+			lws_rx_flow_control(wsi, 0);
+		}
+		// reading is paused, but events keep coming, so those are dropped
+		// fallthrough
+	case WSD_WRITE_Q_DROP_EVENTS:
+		// partly written message has to be finished
+		list_for_each_entry_safe(w, n, &peer->write_q, wq) {
+			if (!wsu_write_q_over(prog, peer, last))
+				break;
+			if (w == last)
+				break;
+			if (!w->event || w->written)
+				continue;
+			++prog->write_q_stats.dropped_events;
+			wsu_writereq_done(wsi, peer, w);
+		}
+		if (!wsu_write_q_over(prog, peer, last) || prog->write_q_policy == WSD_WRITE_Q_PAUSE ||
+				peer->write_q_len <= prog->write_q_max)
+			break;
+		lwsl_warn("write queue %zu over budget with only replies, %lu events dropped so far\n",
+				peer->write_q_len, prog->write_q_stats.dropped_events);
+		// only replies remain, and peer alone is over its budget
+		// fallthrough
+	case WSD_WRITE_Q_DROP_PEER:
+		lwsl_warn("write queue %zu over budget, dropping peer (%lu dropped so far)\n",
+				peer->write_q_len, ++prog->write_q_stats.dropped_peers);
+		peer->write_closed = true;
+		list_for_each_entry_safe(w, n, &peer->write_q, wq)
+			if (!w->written)
+				wsu_writereq_done(wsi, peer, w);
+		// TODO<lwsclose> check
+		// stop reading and writing
+		shutdown(lws_get_socket_fd(wsi), SHUT_RDWR);
+		break;
+	}
+}
+
+/**
+ * \brief queue filled-in write request, taking it over
+ */
+static inline int wsu_queue_writereq(struct lws *wsi, struct wsu_writereq *w)
+{
+	struct wsu_peer *peer = wsi_to_peer(wsi);
+	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+
+	assert(w->len < WSUBUS_MAX_MESSAGE_LEN);
+
+	if (peer->write_closed) {
+		wsu_writereq_free(w);
+		return -1;
+	}
+
+	w->written = 0;
+
+	// fragments of one message have to go out back to back
+	if (w->cont)
+		list_add(&w->wq, peer->stream_pos);
+	else
+		list_add_tail(&w->wq, &peer->write_q);
+	if (w->more)
+		peer->stream_pos = &w->wq;
+	else if (w->cont)
+		peer->stream_pos = NULL;
+	if (w->cont || w->more)
+		++peer->stream_frags;
+
+	peer->write_q_len += w->len;
+	prog->write_q_total += w->len;
+
+	wsu_write_q_overflow(wsi, peer, w);
+	if (peer->write_closed)
+		return -1;
+
+	if (peer->binary)
+		lwsl_debug("sending reply: blob of len %zu ... %p\n", w->len, w);
+	else
+		lwsl_debug("sending reply: %.*s ... %p\n", w->len > 50 ? 50 : (int)w->len,
+				(const char *)(w->shared ? w->shared->buf : w->buf) + LWS_SEND_BUFFER_PRE_PADDING, w);
+	int r = lws_callback_on_writable(wsi);
+
+	if (r < 0) {
+		lwsl_warn("error %d scheduling write callback\n", r);
+		return -3;
+	}
+
+	return 0;
+}
+
+/**
+ * \brief queue data for writing to the other end of WebSocket, as text or
+ * binary message depending on the peer
+ *
+ * \param wsi whom to write to
+ * \param data what to write
+ * \param len how much to write
+ *
+ * @return 0 if succeeded
+ */
+static inline int wsu_queue_write_buf(struct lws *wsi, const void *data, size_t len)
+{
+	struct wsu_writereq *w = malloc(sizeof *w
+			+ LWS_SEND_BUFFER_PRE_PADDING
+			+ len
+			+ LWS_SEND_BUFFER_POST_PADDING);
+	if (!w) {
+		lwsl_err("failed to alloc ubus response buf");
+		return -2;
+	}
+
+	memcpy(w->buf+LWS_SEND_BUFFER_PRE_PADDING, data, len);
+	w->len = len;
+	w->shared = NULL;
+	w->event = false;
+	w->cont = w->more = false;
+
+	return wsu_queue_writereq(wsi, w);
+}
+
 /**
  * \brief queue text data for writing to the other end of WebSocket
  *
@@ -211,42 +486,444 @@ struct wsu_writereq {
  */
 static inline int wsu_queue_write_str(struct lws *wsi, const char *response_str)
 {
-	struct wsu_peer *peer = wsi_to_peer(wsi);
 	if (!response_str) {
 		lwsl_err("Not writing null message\n");
 		return -1;
 	}
 
-	size_t len = strlen(response_str);
+	return wsu_queue_write_buf(wsi, response_str, strlen(response_str));
+}
 
-	assert(len < WSUBUS_MAX_MESSAGE_LEN);
+/**
+ * \brief prepare JSON output so that its buffer is laid out as write request,
+ * and text can be queued in place by wsu_queue_write_json
+ */
+static inline void wsu_json_out_init(struct json_out *o)
+{
+	json_out_init(o, sizeof(struct wsu_writereq) + LWS_SEND_BUFFER_PRE_PADDING, LWS_SEND_BUFFER_POST_PADDING);
+}
 
-	struct wsu_writereq *w = malloc(sizeof *w
-			+ LWS_SEND_BUFFER_PRE_PADDING
-			+ len
-			+ LWS_SEND_BUFFER_POST_PADDING);
-	if (!w) {
-		lwsl_err("failed to alloc ubus response buf");
+/**
+ * \brief queue text written to output prepared by wsu_json_out_init, without
+ * copying it. Output is empty afterwards
+ *
+ * \param event if message is event notification, which may be dropped
+ *
+ * @return 0 if succeeded
+ */
+static inline int wsu_queue_write_json(struct lws *wsi, struct json_out *o, bool event)
+{
+	if (o->error || !o->buf) {
+		lwsl_err("failed to alloc response buf\n");
+		json_out_free(o);
 		return -2;
 	}
 
-	memcpy(w->buf+LWS_SEND_BUFFER_PRE_PADDING, response_str, len);
+	size_t len = o->len;
+	struct wsu_writereq *w = (struct wsu_writereq *)json_out_steal(o);
+	w->len = len;
+	w->shared = NULL;
+	w->event = event;
+	w->cont = w->more = false;
+	return wsu_queue_writereq(wsi, w);
+}
+
+/**
+ * \brief text message which is produced in fragments, each one only when
+ * earlier ones are written out, so whole text never has to be in memory and
+ * slow peer holds back the producer. Messages queued to the peer in the
+ * meantime are sent after it. Only one can be active per peer
+ */
+struct wsu_stream {
+	/** \brief text of next fragment, prepared by wsu_json_out_init */
+	struct json_out out;
+
+	/** \brief append next piece of text to out, return true if it was the last */
+	bool (*fill)(struct wsu_stream *s);
+	/** \brief free the stream, called when it is done or dropped */
+	void (*destroy)(struct wsu_stream *s);
 
+	// first fragment was queued
+	bool open;
+};
+
+/**
+ * \brief whether message to the peer can be streamed now; binary peers get
+ * whole messages
+ */
+static inline bool wsu_stream_possible(struct lws *wsi)
+{
+	struct wsu_peer *peer = wsi_to_peer(wsi);
+	return !peer->binary && !peer->stream && !peer->write_closed;
+}
+
+static inline void wsu_stream_drop(struct wsu_peer *peer)
+{
+	struct wsu_stream *s = peer->stream;
+
+	peer->stream = NULL;
+	json_out_free(&s->out);
+	s->destroy(s);
+}
+
+/**
+ * \brief produce and queue next fragment of peer's stream
+ *
+ * @return 1 if there is more to produce, 0 if stream is done, negative if it
+ * failed and was dropped
+ */
+static inline int wsu_stream_next(struct lws *wsi, struct wsu_peer *peer)
+{
+	struct wsu_stream *s = peer->stream;
+
+	bool done = s->fill(s);
+	if (s->out.error || !s->out.buf) {
+		lwsl_err("failed to alloc streamed message fragment\n");
+		if (s->open && !peer->write_closed) {
+			lwsl_err("streamed message failed midway, dropping peer\n");
+			peer->write_closed = true;
+			// TODO<lwsclose> check
+			// peer has part of message which can't be completed
+			shutdown(lws_get_socket_fd(wsi), SHUT_RDWR);
+		}
+		wsu_stream_drop(peer);
+		return -2;
+	}
+
+	size_t len = s->out.len;
+	struct wsu_writereq *w = (struct wsu_writereq *)json_out_steal(&s->out);
 	w->len = len;
-	w->written = 0;
+	w->shared = NULL;
+	w->event = false;
+	w->cont = s->open;
+	w->more = !done;
+	s->open = true;
 
-	list_add_tail(&w->wq, &peer->write_q);
+	if (done) {
+		peer->stream = NULL;
+		s->destroy(s);
+	}
 
-	lwsl_debug("sending reply: %.*s ... %p\n", len > 50 ? 50 : (int)len, response_str, w);
-	int r = lws_callback_on_writable(wsi);
+	int ret = wsu_queue_writereq(wsi, w);
+	if (ret && peer->write_closed) {
+		if (peer->stream)
+			wsu_stream_drop(peer);
+		return ret;
+	}
 
-	if (r < 0) {
-		lwsl_warn("error %d scheduling write callback\n", r);
-		return -3;
+	return !done;
+}
+
+/**
+ * \brief produce fragments of peer's stream while few enough are queued. The
+ * next one is always produced once all are written, so message is finished
+ * even with write queue over budget
+ */
+static inline void wsu_stream_pump(struct lws *wsi, struct wsu_peer *peer)
+{
+	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+
+	while (peer->stream) {
+		if (peer->write_closed) {
+			wsu_stream_drop(peer);
+			break;
+		}
+
+		if (peer->stream_frags >= WSUBUS_STREAM_FRAG_QUEUED || (peer->stream_frags &&
+					(peer->write_q_len > prog->write_q_max || prog->write_q_total > prog->write_q_max_total)))
+			break;
+
+		if (wsu_stream_next(wsi, peer) <= 0)
+			break;
 	}
+}
 
+/**
+ * \brief start streamed message, taking over s. Beginning of text may be
+ * written to s->out beforehand
+ *
+ * @return 0 if succeeded; otherwise nothing went out, and s is freed
+ */
+static inline int wsu_stream_start(struct lws *wsi, struct wsu_stream *s)
+{
+	struct wsu_peer *peer = wsi_to_peer(wsi);
+
+	assert(!peer->stream);
+
+	s->open = false;
+	peer->stream = s;
+
+	int ret = wsu_stream_next(wsi, peer);
+	if (ret < 0)
+		return ret;
+
+	wsu_stream_pump(wsi, peer);
 	return 0;
 }
+
+/**
+ * \brief collects replies to the elements of one JSON-RPC batch request, so
+ * they can be sent back as single JSON array once all of them are done
+ */
+struct wsu_batch {
+	struct list_head bq;
+
+	/** \brief number of replies still expected, +1 while batch is being dispatched */
+	unsigned int pending;
+
+	// JSON text of replies, for text peers, written in place of write request
+	struct json_out json;
+
+	// array of replies, for binary peers
+	struct blob_buf blob;
+
+	// holds reply to notification (request without id) from a batch, which
+	// is not sent
+	bool quiet;
+};
+
+static inline struct wsu_batch *wsu_batch_new(struct lws *wsi)
+{
+	struct wsu_batch *batch = calloc(1, sizeof *batch);
+	if (!batch)
+		return NULL;
+
+	// dispatching code holds this until all elements were handed to handlers
+	batch->pending = 1;
+	wsu_json_out_init(&batch->json);
+	list_add_tail(&batch->bq, &wsi_to_client(wsi)->batch_q);
+	return batch;
+}
+
+static inline void wsu_batch_free(struct wsu_batch *batch)
+{
+	list_del(&batch->bq);
+	json_out_free(&batch->json);
+	blob_buf_free(&batch->blob);
+	free(batch);
+}
+
+/**
+ * \brief drop one expected reply; when it was the last one, the collected
+ * replies are queued for writing and batch is freed
+ */
+static inline void wsu_batch_put(struct lws *wsi, struct wsu_batch *batch)
+{
+	assert(batch->pending > 0);
+	if (--batch->pending)
+		return;
+
+	if (batch->quiet) {
+		// nothing to send
+	} else if (batch->json.len) {
+		json_out_lit(&batch->json, "]");
+		wsu_queue_write_json(wsi, &batch->json, false);
+	} else if (batch->blob.head) {
+		wsu_queue_write_buf(wsi, batch->blob.head, blob_raw_len(batch->blob.head));
+	}
+	wsu_batch_free(batch);
+}
+
+/**
+ * \brief start JSON text of a reply, either as separate message or as next
+ * element of batch reply array
+ *
+ * \param batch batch the request came in, or NULL
+ * \param single output to use if not in batch
+ *
+ * @return output to write reply to, then pass to wsu_json_end
+ */
+static inline struct json_out *wsu_json_begin(struct wsu_batch *batch, struct json_out *single)
+{
+	if (!batch) {
+		wsu_json_out_init(single);
+		return single;
+	}
+
+	json_out_raw(&batch->json, batch->json.len ? "," : "[", 1);
+	return &batch->json;
+}
+
+/**
+ * \brief finish reply started with wsu_json_begin, queue it or count it as
+ * done in its batch
+ */
+static inline int wsu_json_end(struct lws *wsi, struct wsu_batch *batch, struct json_out *o)
+{
+	if (!batch)
+		return wsu_queue_write_json(wsi, o, false);
+
+	int ret = o->error ? -2 : 0;
+	// even if we failed, other replies in the batch still need to go out
+	wsu_batch_put(wsi, batch);
+	return ret;
+}
+
+/**
+ * \brief write start of JSON-RPC response up to and including the id
+ */
+static inline void wsu_json_resp_prefix(struct json_out *o, struct blob_attr *id)
+{
+	json_out_lit(o, JSONRPC_RESP_PREFIX);
+	if (id)
+		json_out_value(o, id);
+	else
+		json_out_lit(o, "null");
+}
+
+/**
+ * \brief queue message to the peer, formatted as JSON or sent as blobmsg
+ * depending on the protocol peer uses. If it is a reply to request that came
+ * in a batch, it is held back until whole batch is done
+ *
+ * \param wsi whom to write to
+ * \param batch batch the request came in, or NULL
+ * \param msg message made with blob_buf_init(.., 0) and blobmsg_add_*
+ *
+ * @return 0 if succeeded
+ */
+static inline int wsu_queue_msg(struct lws *wsi, struct wsu_batch *batch, struct blob_attr *msg)
+{
+	struct wsu_peer *peer = wsi_to_peer(wsi);
+	int ret = 0;
+
+	if (peer->binary) {
+		if (!batch)
+			return wsu_queue_write_buf(wsi, msg, blob_raw_len(msg));
+
+		if (!batch->blob.head)
+			blob_buf_init(&batch->blob, BLOBMSG_TYPE_ARRAY);
+		if (blobmsg_add_field(&batch->blob, BLOBMSG_TYPE_TABLE, "", blob_data(msg), blob_len(msg))) {
+			lwsl_err("failed to alloc batch response buf\n");
+			ret = -2;
+		}
+	} else {
+		struct json_out single;
+		struct json_out *o = wsu_json_begin(batch, &single);
+		json_out_container(o, msg, false);
+		return wsu_json_end(wsi, batch, o);
+	}
+
+	// even if we failed, other replies in the batch still need to go out
+	wsu_batch_put(wsi, batch);
+	return ret;
+}
+
+/**
+ * \brief queue event notification to the peer, like wsu_queue_msg. If peer
+ * doesn't keep up with reading, these may be dropped, see wsd_write_q_policy
+ */
+static inline int wsu_queue_event(struct lws *wsi, struct blob_attr *msg)
+{
+	if (wsi_to_peer(wsi)->binary) {
+		struct wsu_writereq *w = malloc(sizeof *w
+				+ LWS_SEND_BUFFER_PRE_PADDING
+				+ blob_raw_len(msg)
+				+ LWS_SEND_BUFFER_POST_PADDING);
+		if (!w) {
+			lwsl_err("failed to alloc event buf\n");
+			return -2;
+		}
+		memcpy(w->buf + LWS_SEND_BUFFER_PRE_PADDING, msg, blob_raw_len(msg));
+		w->len = blob_raw_len(msg);
+		w->shared = NULL;
+		w->event = true;
+		w->cont = w->more = false;
+		return wsu_queue_writereq(wsi, w);
+	}
+
+	struct json_out o;
+	wsu_json_out_init(&o);
+	json_out_container(&o, msg, false);
+	return wsu_queue_write_json(wsi, &o, true);
+}
+
+/**
+ * \brief queue event notification to text peer, made of text shared with other
+ * peers and the peer's own text written to output prepared by
+ * wsu_json_out_init, which ends it. Output is empty afterwards
+ */
+static inline int wsu_queue_event_shared(struct lws *wsi, struct wsu_shared_buf *shared, struct json_out *o)
+{
+	if (o->error || !o->buf) {
+		lwsl_err("failed to alloc event buf\n");
+		json_out_free(o);
+		return -2;
+	}
+
+	size_t len = o->len;
+	struct wsu_writereq *w = (struct wsu_writereq *)json_out_steal(o);
+	w->len = shared->len + len;
+	w->shared = wsu_shared_buf_get(shared);
+	w->event = true;
+	w->cont = w->more = false;
+	return wsu_queue_writereq(wsi, w);
+}
+
+/**
+ * \brief send JSON-RPC error reply, see jsonrpc__resp_error
+ */
+static inline int wsu_reply_error(struct lws *wsi, struct wsu_batch *batch,
+		struct blob_attr *id, int error_code, struct blob_attr *error_data)
+{
+	size_t len;
+	const char *suffix;
+	bool has_data = error_data && !strcmp("data", blobmsg_name(error_data));
+
+	// common error replies are pre-rendered, only id is spliced in
+	if (!wsi_to_peer(wsi)->binary && !has_data &&
+			(suffix = jsonrpc__resp_error_suffix(error_code, &len))) {
+		struct json_out single;
+		struct json_out *o = wsu_json_begin(batch, &single);
+		wsu_json_resp_prefix(o, id);
+		json_out_raw(o, suffix, len);
+		return wsu_json_end(wsi, batch, o);
+	}
+
+	struct blob_buf resp_buf = {};
+	jsonrpc__resp_error_blob(&resp_buf, id, error_code, error_data);
+	int ret = wsu_queue_msg(wsi, batch, resp_buf.head);
+	blob_buf_free(&resp_buf);
+	return ret;
+}
+
+/**
+ * \brief send JSON-RPC result reply with ubus status, see jsonrpc__resp_ubus
+ */
+static inline int wsu_reply_ubus(struct lws *wsi, struct wsu_batch *batch,
+		struct blob_attr *id, int ubus_rc, struct blob_attr *ret_data)
+{
+	if (!wsi_to_peer(wsi)->binary) {
+		// write envelope and result data straight into the write buffer,
+		// this reply can carry big result
+		struct json_out single;
+		struct json_out *o = wsu_json_begin(batch, &single);
+
+		wsu_json_resp_prefix(o, id);
+
+		size_t len;
+		const char *suffix = ret_data ? NULL : jsonrpc__resp_status_suffix(ubus_rc, &len);
+		if (suffix) {
+			json_out_raw(o, suffix, len);
+		} else {
+			json_out_lit(o, ",\"result\":[");
+			json_out_int(o, ubus_rc);
+			if (ret_data) {
+				json_out_lit(o, ",");
+				json_out_container(o, ret_data, blobmsg_type(ret_data) == BLOBMSG_TYPE_ARRAY);
+			}
+			json_out_lit(o, "]}");
+		}
+
+		return wsu_json_end(wsi, batch, o);
+	}
+
+	struct blob_buf resp_buf = {};
+	jsonrpc__resp_ubus_blob(&resp_buf, id, ubus_rc, ret_data);
+	int ret = wsu_queue_msg(wsi, batch, resp_buf.head);
+	blob_buf_free(&resp_buf);
+	return ret;
+}
 //}}}
 
 static inline int wsu_sid_update(struct wsu_peer *peer, const char *sid)
@@ -268,6 +945,8 @@ static inline int wsu_peer_init(struct wsu_peer *peer, enum wsu_role role)
 		// these lists will keep track of async calls in progress
 		INIT_LIST_HEAD(&peer->u.client.rpc_call_q);
 		INIT_LIST_HEAD(&peer->u.client.access_check_q);
+		INIT_LIST_HEAD(&peer->u.client.batch_q);
+		avl_init(&peer->u.client.subs, avl_strcmp, true, NULL);
 #if WSD_HAVE_UBUSPROXY
 	} else if (role == WSUBUS_ROLE_REMOTE) {
 #endif
@@ -277,15 +956,22 @@ static inline int wsu_peer_init(struct wsu_peer *peer, enum wsu_role role)
 
 	peer->role = role;
 
-	struct json_tokener *jtok = json_tokener_new();
-
-	if (!jtok)
-		return 1;
-
-	// initialize the parser
 	peer->curr_msg.len = 0;
-	peer->curr_msg.jtok = jtok;
+	peer->curr_msg.frame_len = 0;
+	peer->curr_msg.parser = NULL;
+	peer->curr_msg.buf = NULL;
+	peer->curr_msg.buf_alloc = 0;
+	peer->binary = false;
+	peer->max_msg_len = WSUBUS_MAX_MESSAGE_LEN;
+	peer->max_frame_len = WSUBUS_MAX_MESSAGE_LEN;
+	peer->tls_cert = WSU_TLS_CERT_NONE;
 	INIT_LIST_HEAD(&peer->write_q);
+	peer->write_q_len = 0;
+	peer->rx_paused = false;
+	peer->write_closed = false;
+	peer->stream_pos = NULL;
+	peer->stream = NULL;
+	peer->stream_frags = 0;
 
 	peer->sid[0] = '\0';
 	return 0;
@@ -293,16 +979,26 @@ static inline int wsu_peer_init(struct wsu_peer *peer, enum wsu_role role)
 
 static inline void wsu_peer_deinit(struct lws *wsi, struct wsu_peer *peer)
 {
-	json_tokener_free(peer->curr_msg.jtok);
-	peer->curr_msg.jtok = NULL;
+	if (peer->deflate) {
+		struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+		--prog->deflate_peers;
+		peer->deflate = false;
+	}
+
+	json_blob_parser_pool_put(peer->curr_msg.parser);
+	peer->curr_msg.parser = NULL;
+	free(peer->curr_msg.buf);
+	peer->curr_msg.buf = NULL;
+
+	if (peer->stream)
+		wsu_stream_drop(peer);
 
 	{
 		// free everything from write queue
 		struct wsu_writereq *p, *n;
 		list_for_each_entry_safe(p, n, &peer->write_q, wq) {
 			lwsl_info("free write in progress %p\n", p);
-			list_del(&p->wq);
-			free(p);
+			wsu_writereq_done(wsi, peer, p);
 		}
 	}
 
@@ -345,6 +1041,15 @@ static inline void wsu_peer_deinit(struct lws *wsi, struct wsu_peer *peer)
 				}
 			}
 		}
+
+		{
+			// nothing will reply to these anymore
+			struct wsu_batch *p, *n;
+			list_for_each_entry_safe(p, n, &peer->u.client.batch_q, bq) {
+				lwsl_info("free batch in progress %p\n", p);
+				wsu_batch_free(p);
+			}
+		}
 	}
 #if WSD_HAVE_UBUSPROXY
 	else if (peer->role == WSUBUS_ROLE_REMOTE) {
@@ -356,41 +1061,197 @@ static inline void wsu_peer_deinit(struct lws *wsi, struct wsu_peer *peer)
 #endif
 }
 
+// messages up to this long are packed together into one send, and how much
+// is packed at most, which fits in one TLS record with room to spare
+#define WSUBUS_COALESCE_MSG_LEN 1024
+#define WSUBUS_COALESCE_BUFLEN 8192
+
+/**
+ * \brief write header of unmasked (server to client) websocket frame which
+ * carries whole message
+ *
+ * @return length of header, at most 10
+ */
+static inline size_t wsu_ws_frame_header(unsigned char *p, bool binary, size_t len)
+{
+	p[0] = 0x80 | (binary ? 0x2 : 0x1); // FIN + opcode
+	if (len < 126) {
+		p[1] = (unsigned char)len;
+		return 2;
+	} else if (len <= 0xffff) {
+		p[1] = 126;
+		p[2] = (unsigned char)(len >> 8);
+		p[3] = (unsigned char)len;
+		return 4;
+	}
+
+	p[1] = 127;
+	for (int i = 0; i < 8; ++i)
+		p[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+	return 10;
+}
+
+/**
+ * \brief whether part of fragmented message went out and its next fragment is
+ * not queued yet; until it is, nothing else may be written, or the frames
+ * would end up inside that message
+ */
+static inline bool wsu_stream_waiting(struct wsu_peer *peer)
+{
+	return peer->stream_pos == &peer->write_q
+		&& (list_empty(&peer->write_q)
+				|| !list_first_entry(&peer->write_q, struct wsu_writereq, wq)->cont);
+}
+
+/**
+ * \brief pack run of small messages at the head of write queue into one send;
+ * each of them is still separate websocket frame. Done only on our server side
+ * of connection, since client frames would need masking, and not if peer
+ * uses compression, since raw frames could end up ahead of or inside
+ * compressed output lws has not drained yet
+ *
+ * @return how many messages were sent, 0 if there was nothing to pack, or
+ * negative on write error
+ */
+static inline int wsu_tx_coalesced(struct lws *wsi, struct wsu_peer *peer)
+{
+	static unsigned char buf[LWS_SEND_BUFFER_PRE_PADDING + WSUBUS_COALESCE_BUFLEN];
+	unsigned char *p = buf + LWS_SEND_BUFFER_PRE_PADDING;
+	size_t len = 0;
+	int n = 0;
+
+	if (peer->deflate || wsu_stream_waiting(peer))
+		return 0;
+
+	struct wsu_writereq *w;
+	list_for_each_entry(w, &peer->write_q, wq) {
+		if (w->written || w->cont || w->more || w->len > WSUBUS_COALESCE_MSG_LEN || len + 4 + w->len > WSUBUS_COALESCE_BUFLEN)
+			break;
+		len += wsu_ws_frame_header(p + len, peer->binary, w->len);
+		size_t shared_len = w->shared ? w->shared->len : 0;
+		if (shared_len)
+			memcpy(p + len, w->shared->buf + LWS_SEND_BUFFER_PRE_PADDING, shared_len);
+		memcpy(p + len + shared_len, w->buf + LWS_SEND_BUFFER_PRE_PADDING, w->len - shared_len);
+		len += w->len;
+		++n;
+	}
+
+	// single message goes out the usual way, no need to copy it
+	if (n < 2)
+		return 0;
+
+	// frames are already made, so lws is told to send the bytes as they are;
+	// whatever the socket doesn't take is buffered by lws
+	int written = lws_write(wsi, p, len, LWS_WRITE_HTTP);
+	if (written < 0)
+		return written;
+
+	lwsl_notice("peer IO: fin write of %d coalesced msgs, %zu bytes\n", n, len);
+	for (int i = 0; i < n; ++i) {
+		w = list_first_entry(&peer->write_q, struct wsu_writereq, wq);
+		wsu_writereq_done(wsi, peer, w);
+	}
+
+	return n;
+}
+
+/**
+ * \brief write shared text of write request as first fragment of its message.
+ * It is written whole, lws buffers what the socket doesn't take, since shared
+ * buffer can't be written into past its padding
+ *
+ * @return 0, or negative on write error
+ */
+static inline int wsu_tx_shared(struct lws *wsi, struct wsu_writereq *w, enum lws_write_protocol mode)
+{
+	int written = lws_write(wsi, w->shared->buf + LWS_SEND_BUFFER_PRE_PADDING, w->shared->len, (enum lws_write_protocol)(mode | LWS_WRITE_NO_FIN));
+	if (written < 0)
+		return written;
+
+	w->written = w->shared->len;
+	return 0;
+}
+
 /**
  * \brief when lws calls writable callback, this function drains the write
- * queue using lws_write until we can't write anymore
+ * queue using lws_write until we can't write anymore. Messages go out as
+ * binary frames if peer uses blobmsg protocol, as text otherwise. Runs of
+ * small messages are sent together, see wsu_tx_coalesced
  */
 static inline int wsubus_tx_text(struct lws *wsi)
 {
 	struct wsu_peer *peer = wsi_to_peer(wsi);
 
-	struct wsu_writereq *w, *other;
+	struct wsu_writereq *w;
+	enum lws_write_protocol mode = peer->binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT;
+
+	for (;;) {
+		// next fragment of streamed message is made once earlier ones went out
+		wsu_stream_pump(wsi, peer);
+
+		if (list_empty(&peer->write_q) || wsu_stream_waiting(peer))
+			break;
+
+		int n = 0;
+		if (peer->role == WSUBUS_ROLE_CLIENT)
+			n = wsu_tx_coalesced(wsi, peer);
 
-	list_for_each_entry_safe(w, other, &peer->write_q, wq) {
-		do {
-			int written = lws_write(wsi, w->buf + LWS_SEND_BUFFER_PRE_PADDING + w->written, w->len - w->written, LWS_WRITE_TEXT);
+		if (!n) {
+			w = list_first_entry(&peer->write_q, struct wsu_writereq, wq);
+			size_t shared_len = w->shared ? w->shared->len : 0;
 
-			if (written < 0) {
-				lwsl_err("peer IO: error %d in writing\n", written);
-				// TODO<lwsclose> check
-				// stop reading and writing
-				shutdown(lws_get_socket_fd(wsi), SHUT_RDWR);
-				return -1;
+			if (w->written < shared_len) {
+				n = wsu_tx_shared(wsi, w, mode);
+			} else {
+				// own text of message with shared text is its last fragment
+				int wmode = (w->cont || shared_len ? LWS_WRITE_CONTINUATION : mode) | (w->more ? LWS_WRITE_NO_FIN : 0);
+				do {
+					int written = lws_write(wsi, w->buf + LWS_SEND_BUFFER_PRE_PADDING + w->written - shared_len, w->len - w->written, (enum lws_write_protocol)wmode);
+
+					if (written < 0) {
+						n = written;
+						break;
+					}
+
+					w->written += (size_t)written;
+				} while (w->written < w->len && !lws_partial_buffered(wsi));
 			}
 
-			w->written += (size_t)written;
-		} while (w->written < w->len && !lws_partial_buffered(wsi));
+			if (w->written == w->len) {
+				lwsl_notice("peer IO: fin write %zu\n", w->len);
+				wsu_writereq_done(wsi, peer, w);
+			}
+		}
 
-		if (w->written == w->len) {
-			lwsl_notice("peer IO: fin write %zu\n", w->len);
-			list_del(&w->wq);
-			free(w);
+		if (n < 0) {
+			lwsl_err("peer IO: error %d in writing\n", n);
+			// TODO<lwsclose> check
+			// stop reading and writing
+			shutdown(lws_get_socket_fd(wsi), SHUT_RDWR);
+			return -1;
 		}
+
 		if (lws_partial_buffered(wsi)) {
 			lwsl_notice("client IO: partial buffered");
 			lws_callback_on_writable(wsi);
 			break;
 		}
+
+		// compressed output may be left for lws to drain on next writable
+		// callback, so nothing else can be written before it
+		if (peer->deflate && !n) {
+			if (!list_empty(&peer->write_q) || peer->stream)
+				lws_callback_on_writable(wsi);
+			break;
+		}
+	}
+
+	// peer caught up, take requests from it again
+	struct prog_context *prog = lws_context_user(lws_get_context(wsi));
+	if (peer->rx_paused && peer->write_q_len <= prog->write_q_max / 2) {
+		lwsl_notice("peer IO: write queue drained, resume reading\n");
+		peer->rx_paused = false;
+		lws_rx_flow_control(wsi, 1);
 	}
 
 	return 0;
@@ -81,7 +81,9 @@ lineReader.on('line', function (line) {
 			try {
 				var obj = JSON.parse(line);
 				var curr_test = {req_line: line, obj: obj};
-				tests_by_id[obj.id] = curr_test;
+				// batch replies are matched to the request in flight
+				if (!Array.isArray(obj))
+					tests_by_id[obj.id] = curr_test;
 				tests.push(curr_test);
 			} catch (e) {
 				// skip invalid test
@@ -108,6 +110,20 @@ var ws = new WebSocket(config.url, {
 	origin: config.origin
 });
 
+// send next request; those with "-" as expected reply get none, e.g. batch
+// of notifications, so the one after them goes out right away
+function send_next() {
+	while (sent_tests < tests.length) {
+		var test = tests[sent_tests++];
+		var msg = test.req_line.replace(/SESSION_ID/g, session_id);
+		ws.send(msg, {mask: true});
+		console.log("> " + msg);
+		if (test.resp_line !== "-")
+			return;
+		++recv_tests;
+	}
+}
+
 ws.on('open', function open() {
 	console.log('connected');
 	var msg = tests[sent_tests++].req_line;
@@ -131,12 +147,15 @@ ws.on('message', function message(data, flags) {
 		console.log(chalk.blue("LOGIN " + session_id));
 		++recv_tests;
 	} else {
-		if (typeof obj.id === 'undefined') {
+		if (obj.method === 'event') {
 			// we received event
 			var compare = events[read_events++].resp_line.replace(/SESSION_ID/g, session_id);
 			//console.log(chalk.magenta("event"));
 		} else {
-			var compare = tests_by_id[obj.id].resp_line.replace(/SESSION_ID/g, session_id);
+			// batch reply, or error without id, is for the request in flight
+			var test = (Array.isArray(obj) || obj.id === null || typeof obj.id === 'undefined') ?
+				tests[sent_tests - 1] : tests_by_id[obj.id];
+			var compare = test.resp_line.replace(/SESSION_ID/g, session_id);
 			//console.log(chalk.yellow("resp"));
 			++recv_tests;
 		}
@@ -159,9 +178,9 @@ ws.on('message', function message(data, flags) {
 		ws.close();
 	} else {
 		if (sent_tests === recv_tests) {
-			var msg = tests[sent_tests++].req_line.replace(/SESSION_ID/g, session_id);
-			ws.send(msg, {mask: true});
-			console.log("> " + msg);
+			send_next();
+			if (recv_tests == tests.length && read_events == events.length)
+				ws.close();
 		} else {
 			console.log("+ ");
 		}